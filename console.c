@@ -170,6 +170,14 @@ static void record_error()
     }
 }
 
+/* Name of the innermost command being executed */
+static char *running_cmd = NULL;
+
+char *current_cmd()
+{
+    return running_cmd;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
@@ -181,7 +189,10 @@ static bool interpret_cmda(int argc, char *argv[])
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
     if (next_cmd) {
+        char *outer_cmd = running_cmd;
+        running_cmd = next_cmd->name;
         ok = next_cmd->operation(argc, argv);
+        running_cmd = outer_cmd;
         if (!ok)
             record_error();
     } else {
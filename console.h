@@ -61,6 +61,9 @@ void add_quit_helper(cmd_function qf);
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/* Name of the command being executed, or NULL between commands */
+char *current_cmd();
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
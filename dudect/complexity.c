@@ -0,0 +1,183 @@
+/* Empirical complexity of queue operations
+ *
+ * The operation runs on queues of MIN_SIZE, 2 * MIN_SIZE, ... random strings,
+ * on a fresh queue for each of REPEAT runs, and the median cycle count at
+ * each size stands for that size. Each run builds MAX_SIZE elements in all,
+ * so that the caches are as cold at every size. The medians are then fitted
+ * to a + c * f(n) for each complexity class f by least squares on the
+ * relative error, so that every size weighs the same rather than the
+ * largest one deciding. The constant a takes the cost of the call and of
+ * the cold caches, which would otherwise pass for growth at small sizes.
+ *
+ * Every class then contains O(1), and fits at least as well as it does, so
+ * the class with the smallest error is not picked as is. The spread of the
+ * REPEAT runs gives the standard error of the medians, and the pick is the
+ * slowest growing class whose error is within MARGIN standard errors of the
+ * smallest one. The margin of the fit tells how many standard errors the
+ * errors would have to move to change the pick.
+ *
+ * Sizes stop at MAX_SIZE: beyond it the queue outgrows the caches, and the
+ * jump in cycles per element looks like a faster growing class.
+ */
+
+#include "complexity.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../report.h"
+#include "constant.h"
+#include "cpucycles.h"
+
+#define MIN_SIZE 16
+#define MAX_SIZE (1 << 14)
+#define REPEAT 9
+
+/* Sizes keep doubling until the series has taken TIME_BUDGET seconds, but
+ * there are always at least MIN_SIZES of them
+ */
+#define MIN_SIZES 6
+#define TIME_BUDGET 1.0
+
+/* Standard errors by which a faster growing class has to fit better */
+#define MARGIN 2
+
+/* Cycle counts are too coarse to tell apart relative errors below this */
+#define MIN_NOISE 0.005
+
+const char *complexity_names[complexity_number] = {
+    "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)",
+};
+
+static double complexity_fn(int class, double n)
+{
+    switch (class) {
+    case complexity_log_n:
+        return log2(n);
+    case complexity_n:
+        return n;
+    case complexity_n_log_n:
+        return n * log2(n);
+    case complexity_n2:
+        return n * n;
+    default:
+        return 1;
+    }
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Fit the medians to base + coef * f(size) for class @c, minimizing the sum
+ * of (1 - (base + coef * f(size)) / cycles)^2. A term that would come out
+ * negative is left out, which falls back to a class with one term.
+ */
+static void fit_class(complexity_fit_t *fit, int c)
+{
+    double uu = 0, uv = 0, vv = 0, su = 0, sv = 0;
+    for (size_t i = 0; i < fit->count; i++) {
+        double u = 1 / fit->cycles[i];
+        double v = complexity_fn(c, fit->size[i]) / fit->cycles[i];
+        uu += u * u;
+        uv += u * v;
+        vv += v * v;
+        su += u;
+        sv += v;
+    }
+    double det = uu * vv - uv * uv;
+    double base = 0, coef = 0;
+    if (c != complexity_1 && det > 0) {
+        base = (su * vv - sv * uv) / det;
+        coef = (uu * sv - uv * su) / det;
+    }
+    if (coef <= 0) {
+        base = su / uu;
+        coef = 0;
+    } else if (base < 0) {
+        base = 0;
+        coef = sv / vv;
+    }
+    fit->base[c] = base;
+    fit->coef[c] = coef;
+
+    double rss = 0;
+    for (size_t i = 0; i < fit->count; i++) {
+        double e = 1 - (base + coef * complexity_fn(c, fit->size[i])) /
+                           fit->cycles[i];
+        rss += e * e;
+    }
+    fit->rms[c] = sqrt(rss / fit->count);
+}
+
+bool fit_complexity(int mode, complexity_fit_t *fit)
+{
+    double start, elapsed = 0;
+    double spread[COMPLEXITY_MAX_SIZES];
+    init_time(&start);
+    cpucycles_open();
+    fit->count = 0;
+    for (size_t size = MIN_SIZE;
+         size <= MAX_SIZE && fit->count < COMPLEXITY_MAX_SIZES; size *= 2) {
+        if (fit->count >= MIN_SIZES && elapsed > TIME_BUDGET)
+            break;
+        int64_t runs[REPEAT];
+        for (int r = 0; r < REPEAT; r++)
+            runs[r] = measure_size(mode, size, MAX_SIZE);
+        qsort(runs, REPEAT, sizeof(int64_t), cmp_int64);
+        fit->size[fit->count] = size;
+        fit->cycles[fit->count] = runs[REPEAT / 2];
+        /* Interquartile range, relative to the median */
+        spread[fit->count] =
+            (double) (runs[REPEAT - 1 - REPEAT / 4] - runs[REPEAT / 4]) /
+            runs[REPEAT / 2];
+        fit->count++;
+        elapsed += delta_time(&start);
+    }
+    cpucycles_close();
+
+    for (size_t i = 0; i < fit->count; i++) {
+        if (fit->cycles[i] <= 0)
+            return false;
+    }
+
+    /* The standard error of a median is close to the interquartile range
+     * over the square root of the number of runs
+     */
+    qsort(spread, fit->count, sizeof(double), cmp_double);
+    fit->noise = spread[fit->count / 2] / sqrt(REPEAT);
+    if (fit->noise < MIN_NOISE)
+        fit->noise = MIN_NOISE;
+
+    int lowest = 0;
+    for (int c = 0; c < complexity_number; c++) {
+        fit_class(fit, c);
+        if (fit->rms[c] < fit->rms[lowest])
+            lowest = c;
+    }
+    double bar = fit->rms[lowest] + MARGIN * fit->noise;
+    fit->best = 0;
+    while (fit->rms[fit->best] > bar)
+        fit->best++;
+
+    /* A slower growing class would be picked if its error came within the
+     * bar, and a faster growing one if its error fell below the bar it
+     * would set
+     */
+    fit->margin = INFINITY;
+    for (int c = 0; c < complexity_number; c++) {
+        double gap = c < fit->best ? fit->rms[c] - bar
+                                   : fit->rms[c] + MARGIN * fit->noise -
+                                         fit->rms[fit->best];
+        if (c != fit->best && gap / fit->noise < fit->margin)
+            fit->margin = gap / fit->noise;
+    }
+    return true;
+}
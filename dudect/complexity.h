@@ -0,0 +1,39 @@
+#ifndef DUDECT_COMPLEXITY_H
+#define DUDECT_COMPLEXITY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Complexity classes an operation can be fitted to */
+enum {
+    complexity_1,
+    complexity_log_n,
+    complexity_n,
+    complexity_n_log_n,
+    complexity_n2,
+    complexity_number,
+};
+
+/* Largest number of queue sizes in a series */
+#define COMPLEXITY_MAX_SIZES 16
+
+typedef struct {
+    int best;                            /* class picked by fit_complexity() */
+    double noise;                        /* relative standard error of cycles */
+    double margin;                       /* noise units from another pick */
+    double base[complexity_number];      /* cycles that do not grow */
+    double coef[complexity_number];      /* cycles per unit of each class */
+    double rms[complexity_number];       /* rms of the relative errors */
+    size_t count;                        /* queue sizes measured */
+    size_t size[COMPLEXITY_MAX_SIZES];   /* queue sizes */
+    double cycles[COMPLEXITY_MAX_SIZES]; /* median cycles at each size */
+} complexity_fit_t;
+
+extern const char *complexity_names[complexity_number];
+
+/* Time operation @mode, one of the test_* constants, over a geometric
+ * series of queue sizes and fit the timings to each complexity class
+ */
+bool fit_complexity(int mode, complexity_fit_t *fit);
+
+#endif
@@ -10,29 +10,39 @@
 #include "queue.h"
 #include "random.h"
 
-#define N_MEASURE 150
+/* Number of random strings cycled through by the measurements */
+#define N_STRINGS 150
 
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
 
 /* Number of measurements per test */
-const size_t n_measure = N_MEASURE;
+int n_measure = 150;
 
-const int drop_size = 20;
+/* Measurements left out at either end of a batch */
+int drop_size = 20;
 
 /* Maintain a queue independent from the qtest since
  * we do not want the test to affect the original functionality
  */
 static struct list_head *l = NULL;
+static struct list_head *ballast = NULL;
+static volatile char warm; /* sink of the reads in dut_fill() */
 
-static char random_string[N_MEASURE][8];
+static char random_string[N_STRINGS][8];
 static int random_string_iter = 0;
 
-enum {
-    test_insert_head,
-    test_insert_tail,
-    test_remove_head,
-    test_remove_tail,
+/* Operations whose cost grows with the queue run on queues of this many
+ * elements, with strings that depend on the class. The others run on
+ * queues whose length depends on the class.
+ */
+#define FIXED_SIZE 64
+
+static const bool fixed_size[test_number] = {
+    [test_delete_mid] = true,
+    [test_swap] = true,
+    [test_reverse] = true,
+    [test_sort] = true,
 };
 
 /* Implement the necessary queue interface to simulation */
@@ -43,7 +53,7 @@ void init_dut(void)
 
 char *get_random_string(void)
 {
-    random_string_iter = (random_string_iter + 1) % N_MEASURE;
+    random_string_iter = (random_string_iter + 1) % N_STRINGS;
     return random_string[random_string_iter];
 }
 
@@ -56,86 +66,143 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
             memset(input_data + (size_t) i * chunk_size, 0, chunk_size);
     }
 
-    for (size_t i = 0; i < N_MEASURE; ++i) {
-        /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
-        random_string[i][7] = 0;
-    }
+    /* Generate random strings */
+    prng_strings(random_string[0], N_STRINGS, sizeof(random_string[0]), 7, 7);
 }
 
-void measure(int64_t *before_ticks,
-             int64_t *after_ticks,
-             uint8_t *input_data,
-             int mode)
+/* Largest length of a queue of random length */
+#define MAX_LENGTH 10000
+
+/* Fill the queue for one measurement from its 16-bit input: a queue of
+ * random length for most operations, and one of FIXED_SIZE elements with
+ * strings picked by the input bytes for the others. Class 0 inputs are
+ * zero, giving a queue of a single element or one whose strings are all
+ * the same.
+ *
+ * Building and freeing thousands of elements leaves the caches and the
+ * branch predictors in a state that the cropped tests tell apart from a
+ * short queue, so the ballast queue takes the remaining elements and each
+ * measurement does the same work before the operation runs. The queue is
+ * built last and both its ends are read, so that they are in the caches
+ * whatever its length. It is never empty, as removing from it would take
+ * the early return for an empty queue, which has nothing to do with its
+ * length.
+ */
+static void dut_fill(const uint8_t *input, int mode)
 {
-    assert(mode == test_insert_head || mode == test_insert_tail ||
-           mode == test_remove_head || mode == test_remove_tail);
+    if (!fixed_size[mode]) {
+        int n = 1 + *(uint16_t *) input % MAX_LENGTH;
+        char *s = get_random_string();
+        ballast = q_new();
+        for (int k = n; k < MAX_LENGTH; k++)
+            q_insert_head(ballast, s);
+        dut_insert_head(s, n);
+        warm = list_first_entry(l, element_t, list)->value[0] +
+               list_last_entry(l, element_t, list)->value[0];
+        return;
+    }
+    for (size_t k = 0; k < FIXED_SIZE; k++)
+        q_insert_tail(l, random_string[input[k % chunk_size] % N_STRINGS]);
+}
 
+static inline element_t *dut_run(int mode, char *s)
+{
     switch (mode) {
     case test_insert_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
+        dut_insert_head(s, 1);
         break;
     case test_insert_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
+        dut_insert_tail(s, 1);
         break;
     case test_remove_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
-        }
-        break;
+        return q_remove_head(l, NULL, 0);
     case test_remove_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
-        }
+        return q_remove_tail(l, NULL, 0);
+    case test_size:
+        dut_size(1);
+        break;
+    case test_delete_mid:
+        q_delete_mid(l);
+        break;
+    case test_swap:
+        q_swap(l);
+        break;
+    case test_reverse:
+        q_reverse(l);
+        break;
+    case test_sort:
+        q_sort(l);
         break;
-    default:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
     }
+    return NULL;
+}
+
+/* Time one run of operation @mode on a queue of @size random strings. As
+ * in dut_fill(), the ballast queue takes the rest of @total elements, so
+ * that every size leaves the caches in the same state. An untimed run
+ * then brings the queue into the caches, except for q_sort, which would
+ * leave the queue sorted.
+ */
+int64_t measure_size(int mode, size_t size, size_t total)
+{
+    assert(mode >= 0 && mode < test_number);
+
+    prng_strings(random_string[0], N_STRINGS, sizeof(random_string[0]), 7, 7);
+    dut_new();
+    for (size_t k = 0; k < size; k++)
+        q_insert_head(l, random_string[prng_next() % N_STRINGS]);
+    ballast = q_new();
+    for (size_t k = size; k < total; k++)
+        q_insert_head(ballast, random_string[prng_next() % N_STRINGS]);
+    element_t *e = NULL;
+    if (mode != test_sort)
+        e = dut_run(mode, get_random_string());
+    if (e)
+        q_release_element(e);
+    char *s = get_random_string();
+    int64_t before = measure_start();
+    e = dut_run(mode, s);
+    int64_t after = measure_stop();
+    if (e)
+        q_release_element(e);
+    dut_free();
+    q_free(ballast);
+    ballast = NULL;
+    return after - before;
+}
+
+/* One batch of measurements, reading the counter with @start and @stop.
+ * Each counter gets its own loop so that choosing among them adds nothing
+ * to the measured code.
+ */
+#define measure_batch(start, stop)                                  \
+    do {                                                            \
+        for (size_t i = drop_size; i < n_measure - drop_size; i++) { \
+            char *s = get_random_string();                          \
+            dut_new();                                              \
+            dut_fill(input_data + i * chunk_size, mode);            \
+            before_ticks[i] = start;                                \
+            element_t *e = dut_run(mode, s);                        \
+            after_ticks[i] = stop;                                  \
+            if (e)                                                  \
+                q_release_element(e);                               \
+            dut_free();                                             \
+            q_free(ballast);                                        \
+            ballast = NULL;                                         \
+        }                                                           \
+    } while (0)
+
+void measure(int64_t *before_ticks,
+             int64_t *after_ticks,
+             uint8_t *input_data,
+             int mode)
+{
+    assert(mode >= 0 && mode < test_number);
+
+    if (counter_page)
+        measure_batch(counter_read(), counter_read());
+    else if (cycle_counter != counter_tsc)
+        measure_batch(cpucycles_start(), cpucycles_stop());
+    else
+        measure_batch(cpucycles(), cpucycles());
 }
@@ -1,7 +1,29 @@
 #ifndef DUDECT_CONSTANT_H
 #define DUDECT_CONSTANT_H
 
+#include <stddef.h>
 #include <stdint.h>
+
+/* Number of measurements in a batch, and how many of them are left out at
+ * either end. Set through the "measure" and "drop" options of qtest.
+ */
+extern int n_measure;
+extern int drop_size;
+
+/* Operations the simulation can measure */
+enum {
+    test_insert_head,
+    test_insert_tail,
+    test_remove_head,
+    test_remove_tail,
+    test_size,
+    test_delete_mid,
+    test_swap,
+    test_reverse,
+    test_sort,
+    test_number,
+};
+
 #define dut_new() ((void) (l = q_new()))
 
 #define dut_size(n)                                \
@@ -28,6 +50,7 @@
 
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
+int64_t measure_size(int mode, size_t size, size_t total);
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
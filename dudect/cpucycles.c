@@ -0,0 +1,115 @@
+/* Counter and CPU affinity set-up for measurements
+ *
+ * Measurements read the time stamp counter, which the CPU may read before
+ * the code ahead of it has completed or after the code behind it has
+ * started. By default, serializing instructions around the reads keep the
+ * measured code apart from its surroundings. Hardware cycle or instruction
+ * counts from perf_event_open(2) leave out time spent in other processes
+ * and the kernel. They are read with rdpmc through the page the kernel maps
+ * for the counter, as a read(2) per reading would put the system call in
+ * the measured time. Pinning the measuring thread keeps it from migrating
+ * between CPUs whose counters or caches differ.
+ */
+
+#define _GNU_SOURCE
+#include "cpucycles.h"
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#include "../report.h"
+
+int cycle_counter = counter_serialized;
+int pin_cpu = -1;
+
+struct perf_event_mmap_page *counter_page = NULL;
+bool have_rdtscp = false;
+
+static int counter_fd = -1;
+static size_t counter_page_size;
+
+static cpu_set_t saved_affinity;
+static bool pinned = false;
+
+static int perf_open(int counter)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = counter == counter_instructions ? PERF_COUNT_HW_INSTRUCTIONS
+                                                  : PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Open the perf counter and map its page, or leave counter_page NULL when
+ * the counter cannot be read from user space
+ */
+static void counter_map(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    counter_fd = perf_open(cycle_counter);
+    if (counter_fd >= 0) {
+        counter_page_size = sysconf(_SC_PAGESIZE);
+        void *page = mmap(NULL, counter_page_size, PROT_READ, MAP_SHARED,
+                          counter_fd, 0);
+        if (page != MAP_FAILED) {
+            counter_page = page;
+            if (counter_page->cap_user_rdpmc)
+                return;
+            munmap(page, counter_page_size);
+            counter_page = NULL;
+        }
+        close(counter_fd);
+        counter_fd = -1;
+    }
+#endif
+    report_event(MSG_WARN,
+                 "No perf counters, measuring with serialized time stamps");
+}
+
+void cpucycles_open(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    have_rdtscp = __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) &&
+                  (edx & (1 << 27));
+#endif
+
+    if (pin_cpu >= 0 && !pinned) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pin_cpu, &set);
+        if (!sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity) &&
+            !sched_setaffinity(0, sizeof(set), &set)) {
+            pinned = true;
+        } else {
+            report_event(MSG_WARN, "Cannot pin measurements to CPU %d",
+                         pin_cpu);
+        }
+    }
+
+    if (cycle_counter >= counter_cycles && !counter_page)
+        counter_map();
+}
+
+void cpucycles_close(void)
+{
+    if (counter_page) {
+        munmap(counter_page, counter_page_size);
+        close(counter_fd);
+        counter_page = NULL;
+        counter_fd = -1;
+    }
+    if (pinned) {
+        sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+        pinned = false;
+    }
+}
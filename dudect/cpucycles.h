@@ -1,4 +1,10 @@
+#ifndef DUDECT_CPUCYCLES_H
+#define DUDECT_CPUCYCLES_H
+
+#include <linux/perf_event.h>
+#include <stdbool.h>
 #include <stdint.h>
+
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
 static inline int64_t cpucycles(void)
 {
@@ -21,3 +27,113 @@ static inline int64_t cpucycles(void)
 #error Unsupported Architecture
 #endif
 }
+
+/* Counters a measurement can read, set through the "counter" option of
+ * qtest: the time stamp counter as is, or serialized against the measured
+ * code, or perf cycle or instruction counts. The perf ones fall back to
+ * serialized time stamps when the kernel does not let user space read them.
+ */
+enum {
+    counter_tsc,
+    counter_serialized,
+    counter_cycles,
+    counter_instructions,
+};
+
+extern int cycle_counter;
+extern int pin_cpu; /* CPU to run measurements on, or -1 */
+
+/* Set while measuring: the page of the perf counter, or NULL for time
+ * stamps
+ */
+extern struct perf_event_mmap_page *counter_page;
+extern bool have_rdtscp;
+
+/* Set up the counter and the CPU affinity around a series of measurements */
+void cpucycles_open(void);
+void cpucycles_close(void);
+
+/* Read the time stamp counter once the code before has completed, and
+ * before the code after starts
+ */
+static inline int64_t cpucycles_start(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("lfence\n\trdtsc\n\tlfence"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val) : : "memory");
+    return val;
+#endif
+}
+
+/* As cpucycles_start(), with rdtscp waiting for the code before where the
+ * CPU has it
+ */
+static inline int64_t cpucycles_stop(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    if (!have_rdtscp)
+        return cpucycles_start();
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\tlfence"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)
+                     :
+                     : "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    return cpucycles_start();
+#endif
+}
+
+/* Read the perf counter with rdpmc, as described for the user page in
+ * perf_event_open(2). The kernel bumps the lock of the page whenever it
+ * moves the counter, in which case the reading is retried.
+ */
+static inline int64_t counter_read(void)
+{
+    int64_t count = 0;
+#if defined(__i386__) || defined(__x86_64__)
+    uint32_t seq;
+    do {
+        seq = counter_page->lock;
+        __asm__ volatile("" : : : "memory");
+        uint32_t index = counter_page->index;
+        count = counter_page->offset;
+        if (index) {
+            unsigned int hi, lo;
+            __asm__ volatile("lfence\n\trdpmc\n\tlfence"
+                             : "=a"(lo), "=d"(hi)
+                             : "c"(index - 1)
+                             : "memory");
+            int shift = 64 - counter_page->pmc_width;
+            uint64_t pmc = ((uint64_t) lo) | (((uint64_t) hi) << 32);
+            count += (int64_t) (pmc << shift) >> shift;
+        }
+        __asm__ volatile("" : : : "memory");
+    } while (counter_page->lock != seq);
+#endif
+    return count;
+}
+
+/* Counter readings taken around the measured code */
+static inline int64_t measure_start(void)
+{
+    if (counter_page)
+        return counter_read();
+    return cycle_counter != counter_tsc ? cpucycles_start() : cpucycles();
+}
+
+static inline int64_t measure_stop(void)
+{
+    if (counter_page)
+        return counter_read();
+    return cycle_counter != counter_tsc ? cpucycles_stop() : cpucycles();
+}
+
+#endif
@@ -36,15 +36,64 @@
 #include "../console.h"
 #include "../random.h"
 #include "constant.h"
+#include "cpucycles.h"
 #include "ttest.h"
 
-#define enough_measure 10000
-#define test_tries 10
+int enough_measure = 10000;
+int test_tries = 10;
+int sequential_stop = 1;
+
+/* With sequential_stop set, an attempt ends early once the largest t,
+ * widened by this many standard errors and projected to enough_measure,
+ * stays below t_threshold_moderate. Outliers in the first batches can lift
+ * t past the moderate threshold for a while, so only t_threshold_bananas
+ * ends an attempt early on the other side. Either way, every test expected
+ * to take part by enough_measure must take part already.
+ */
+#define stop_margin 3
+
+/* Cropped tests, each keeping the measurements below one percentile of
+ * the first percentile_samples measurements of the attempt, which are held
+ * back from them until the percentiles are known. With the test on
+ * uncropped measurements and the second order test, that makes
+ * number_tests in all.
+ */
+#define number_percentiles 100
+#define number_tests (number_percentiles + 2)
+#define percentile_samples 1000
+
+/* The second order test centers measurements on the class means, so it
+ * waits until the uncropped test holds this many of class 0
+ */
+#define second_order_start 1000
+
+/* A test only takes part in the verdict once it holds this many
+ * measurements of each class, so that a few outliers in a sparse crop
+ * cannot decide it
+ */
+#define test_min_measure 500
 
-extern const int drop_size;
 extern const size_t chunk_size;
-extern const size_t n_measure;
-static t_ctx *t;
+static t_ctx *t; /* uncropped, cropped by percentile, then second order */
+static int64_t percentiles[number_percentiles];
+static bool have_percentiles;
+static size_t n_samples; /* measurements held back for the percentiles */
+
+/* Buffers of a batch, allocated once per TEST_CONST */
+static int64_t *before_ticks;
+static int64_t *after_ticks;
+static int64_t *exec_times;
+static int64_t *sample_times, *sorted_times;
+static uint8_t *sample_classes;
+static uint8_t *classes;
+static uint8_t *input_data;
+
+/* Outcome of a batch */
+enum {
+    measure_more,
+    leakage_found,
+    no_leakage,
+};
 
 /* threshold values for Welch's t-test */
 enum {
@@ -65,6 +114,43 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Share of the measurements kept by cropping threshold i. The thresholds
+ * get denser towards the fast end.
+ */
+static double crop_share(size_t i)
+{
+    return 1 - pow(0.5, 10 * (double) (i + 1) / number_percentiles);
+}
+
+/* Do a t-test on cropped execution times, for several cropping thresholds */
+static void push_cropped(int64_t difference, uint8_t class)
+{
+    for (size_t crop = 0; crop < number_percentiles; crop++) {
+        if (difference < percentiles[crop])
+            t_push(&t[crop + 1], difference, class);
+    }
+}
+
+/* Set the cropping thresholds from the measurements held back, and push
+ * these to the cropped tests
+ */
+static void prepare_percentiles(void)
+{
+    memcpy(sorted_times, sample_times, n_samples * sizeof(int64_t));
+    qsort(sorted_times, n_samples, sizeof(int64_t), cmp_int64);
+    for (size_t i = 0; i < number_percentiles; i++)
+        percentiles[i] = sorted_times[(size_t) (crop_share(i) * n_samples)];
+    have_percentiles = true;
+    for (size_t i = 0; i < n_samples; i++)
+        push_cropped(sample_times[i], sample_classes[i]);
+}
+
 static void update_statistics(const int64_t *exec_times, uint8_t *classes)
 {
     for (size_t i = 0; i < n_measure; i++) {
@@ -74,22 +160,86 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&t[0], difference, classes[i]);
+
+        if (have_percentiles) {
+            push_cropped(difference, classes[i]);
+        } else {
+            sample_times[n_samples] = difference;
+            sample_classes[n_samples++] = classes[i];
+            if (n_samples == percentile_samples)
+                prepare_percentiles();
+        }
+
+        /* do a second-order test, on the centered squared execution time */
+        if (t[0].n[0] > second_order_start) {
+            double x = difference - t[0].mean[classes[i]];
+            t_push(&t[number_tests - 1], x * x, classes[i]);
+        }
     }
 }
 
-static bool report(void)
+/* Test with the largest t statistic among those with enough measurements */
+static t_ctx *max_test(void)
+{
+    t_ctx *ret = &t[0];
+    double max = 0;
+    for (size_t i = 0; i < number_tests; i++) {
+        if (t[i].n[0] < test_min_measure || t[i].n[1] < test_min_measure)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (max < x) {
+            max = x;
+            ret = &t[i];
+        }
+    }
+    return ret;
+}
+
+/* Whether test i can be expected to hold test_min_measure measurements of
+ * each class by enough_measure
+ */
+static bool test_expected(size_t i)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
+    double per_class = enough_measure / 2.0;
+    if (i == number_tests - 1)
+        per_class -= second_order_start;
+    else if (i > 0)
+        per_class *= crop_share(i - 1);
+    return per_class >= test_min_measure;
+}
+
+/* Whether every test expected to take part in the verdict already does */
+static bool tests_ready(void)
+{
+    for (size_t i = 0; i < number_tests; i++) {
+        if (test_expected(i) && (t[i].n[0] < test_min_measure ||
+                                 t[i].n[1] < test_min_measure))
+            return false;
+    }
+    return true;
+}
+
+static int report(void)
+{
+    t_ctx *worst = max_test();
+    double max_t = fabs(t_compute(worst));
+    double number_traces = t[0].n[0] + t[0].n[1];
+    double number_traces_max_t = worst->n[0] + worst->n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measure) {
-        printf("not enough measurements (%.0f still to go).\n",
-               enough_measure - number_traces_max_t);
-        return false;
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    if (number_traces < enough_measure) {
+        double reach = (max_t + stop_margin) *
+                       sqrt(enough_measure / number_traces_max_t);
+        bool below = reach < t_threshold_moderate;
+        bool above = max_t > t_threshold_bananas;
+        if (!sequential_stop || !(below || above) || !tests_ready()) {
+            printf("not enough measurements (%.0f still to go).\n",
+                   enough_measure - number_traces);
+            return measure_more;
+        }
     }
 
     /* max_t: the t statistic value
@@ -107,86 +257,101 @@ static bool report(void)
 
     /* Definitely not constant time */
     if (max_t > t_threshold_bananas)
-        return false;
+        return leakage_found;
 
     /* Probably not constant time. */
     if (max_t > t_threshold_moderate)
-        return false;
+        return leakage_found;
 
     /* For the moment, maybe constant time. */
-    return true;
+    return no_leakage;
 }
 
-static bool doit(int mode)
+static void alloc_buffers(void)
 {
-    int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(n_measure, sizeof(int64_t));
-    uint8_t *classes = calloc(n_measure, sizeof(uint8_t));
-    uint8_t *input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
+    before_ticks = calloc(n_measure + 1, sizeof(int64_t));
+    after_ticks = calloc(n_measure + 1, sizeof(int64_t));
+    exec_times = calloc(n_measure, sizeof(int64_t));
+    sample_times = calloc(percentile_samples, sizeof(int64_t));
+    sorted_times = calloc(percentile_samples, sizeof(int64_t));
+    sample_classes = calloc(percentile_samples, sizeof(uint8_t));
+    classes = calloc(n_measure, sizeof(uint8_t));
+    input_data = calloc(n_measure * chunk_size, sizeof(uint8_t));
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
+    if (!before_ticks || !after_ticks || !exec_times || !sample_times ||
+        !sorted_times || !sample_classes || !classes || !input_data) {
         die();
     }
+}
 
-    prepare_inputs(input_data, classes);
-
-    measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
-
+static void free_buffers(void)
+{
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
+    free(sample_times);
+    free(sorted_times);
+    free(sample_classes);
     free(classes);
     free(input_data);
+}
 
-    return ret;
+static int doit(int mode)
+{
+    prepare_inputs(input_data, classes);
+
+    measure(before_ticks, after_ticks, input_data, mode);
+    differentiate(exec_times, before_ticks, after_ticks);
+    update_statistics(exec_times, classes);
+    return report();
 }
 
 static void init_once(void)
 {
     init_dut();
-    t_init(t);
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&t[i]);
+    have_percentiles = false;
+    n_samples = 0;
 }
 
-static bool TEST_CONST(char *text, int mode)
+static bool TEST_CONST(const char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    t = malloc(number_tests * sizeof(t_ctx));
+    if (!t)
+        die();
+    alloc_buffers();
+    cpucycles_open();
 
     for (int cnt = 0; cnt < test_tries; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
         init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
-            result = doit(mode);
+        int batches = enough_measure / (n_measure - drop_size * 2) + 1;
+        int outcome = measure_more;
+        for (int i = 0; i < batches && outcome == measure_more; ++i)
+            outcome = doit(mode);
         printf("\033[A\033[2K\033[A\033[2K");
+        result = outcome == no_leakage;
         if (result == true)
             break;
     }
+    cpucycles_close();
+    free_buffers();
     free(t);
     return result;
 }
 
-bool is_insert_head_const(void)
-{
-    return TEST_CONST("insert_head", 0);
-}
-
-bool is_insert_tail_const(void)
-{
-    return TEST_CONST("insert_tail", 1);
-}
-
-bool is_remove_head_const(void)
-{
-    return TEST_CONST("remove_head", 2);
-}
+/* Names of the operations, indexed like the test_* constants */
+static const char *test_names[test_number] = {
+    [test_insert_head] = "insert_head", [test_insert_tail] = "insert_tail",
+    [test_remove_head] = "remove_head", [test_remove_tail] = "remove_tail",
+    [test_size] = "size",               [test_delete_mid] = "delete_mid",
+    [test_swap] = "swap",               [test_reverse] = "reverse",
+    [test_sort] = "sort",
+};
 
-bool is_remove_tail_const(void)
+bool is_const(int mode)
 {
-    return TEST_CONST("remove_tail", 3);
+    return TEST_CONST(test_names[mode], mode);
 }
@@ -4,10 +4,18 @@
 #include <stdbool.h>
 #include "constant.h"
 
-/* Interface to test if function is constant */
-bool is_insert_head_const(void);
-bool is_insert_tail_const(void);
-bool is_remove_head_const(void);
-bool is_remove_tail_const(void);
+/* Measurements needed for a verdict, number of attempts before a function
+ * is deemed variable time, and whether an attempt may stop before taking
+ * enough_measure measurements once its outcome is clear. Set through the
+ * "enough", "tries" and "sequential" options of qtest.
+ */
+extern int enough_measure;
+extern int test_tries;
+extern int sequential_stop;
+
+/* Interface to test if operation @mode, one of the test_* constants, runs
+ * in constant time
+ */
+bool is_const(int mode);
 
 #endif
@@ -35,6 +35,9 @@ double t_compute(t_ctx *ctx)
     var[1] = ctx->m2[1] / (ctx->n[1] - 1);
     double num = (ctx->mean[0] - ctx->mean[1]);
     double den = sqrt(var[0] / ctx->n[0] + var[1] / ctx->n[1]);
+    /* Exact counts, such as instructions, may not vary at all */
+    if (den == 0)
+        return num == 0 ? 0 : num * INFINITY;
     double t_value = num / den;
     return t_value;
 }
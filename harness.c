@@ -1,10 +1,19 @@
 /* Test support code */
 
+#define _GNU_SOURCE /* dladdr */
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -18,6 +27,12 @@
 /* Value at start of every allocated block */
 #define MAGICHEADER 0xdeadbeef
 
+/* Value at start of every allocated block left out of the sample */
+#define MAGICLIGHT 0xfeedbeef
+
+/* Value at start of every allocated block followed by a guard page */
+#define MAGICGUARD 0xdeadfeed
+
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
@@ -29,48 +44,907 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header of every allocated block */
 typedef struct BELE {
-    struct BELE *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    size_t magic_header;  /* Marker to see if block seems legitimate */
+    size_t birth;         /* alloc_clock when allocated, or next remote free */
+    unsigned int site;    /* index into sites[] */
+    unsigned int guarded; /* whether it sits before a guard page */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Set of allocated blocks, as an open-addressing hash table with linear
+ * probing keyed by block address. It is kept at most half full, so both
+ * checking and removing a block take expected constant time.
+ *
+ * Each thread tracks the blocks it allocates in a cache of its own, which
+ * only that thread changes, so allocating and freeing its own blocks takes
+ * no lock and no locked instruction. Other threads look blocks up in it
+ * under a sequence count: the owner makes it odd while it changes the
+ * table, and a lookup that saw it odd or moving is retried. Tables replaced
+ * as the cache grows are kept, since a lookup may still be probing them;
+ * they add up to less than the current one.
+ *
+ * Whichever thread frees or moves a block first claims it by swapping its
+ * header, so that a double free racing from two threads is caught. A block
+ * freed by another thread is handed to its owner through a list of remote
+ * frees. The owner takes such blocks off its table and releases them the
+ * next time it allocates or frees. From looking a block up until it has
+ * claimed it or given up, another thread counts as a reader of the cache,
+ * and the owner only gives the memory of a block back once the block is
+ * off its table and no reader is left, so that nobody touches it after.
+ *
+ * Caches are never freed: when its thread exits, a cache goes to the next
+ * thread that starts allocating, along with the blocks it still tracks.
+ * Remote frees to a cache without owner are applied under caches_lock.
+ */
+#define ALLOC_TABLE_MIN_BITS 10
+
+typedef struct TABLE {
+    struct TABLE *retired; /* table this one replaced */
+    int bits;
+    block_ele_t *_Atomic slot[];
+} alloc_table_t;
+
+/* Blocks left out of the sample, as one bit per LIGHT_GRAIN bytes of
+ * address space that is set while a block starts there. The bits are kept
+ * in chunks covering 2^LIGHT_CHUNK_BITS bytes each, allocated the first
+ * time a block starts in them and found through a directory hashed like a
+ * table of blocks. Setting or clearing a bit takes a probe of the directory
+ * and a store, and a pointer can be looked up before any of its memory is
+ * read. Chunks are never freed, and directories replaced as they grow are
+ * kept for the same reason as tables.
+ */
+#define LIGHT_GRAIN _Alignof(max_align_t) /* alignment of malloc blocks */
+#define LIGHT_CHUNK_BITS 20
+#define LIGHT_CHUNK_WORDS (((size_t) 1 << LIGHT_CHUNK_BITS) / LIGHT_GRAIN / 64)
+#define LIGHT_MAP_MIN_BITS 4
+
+typedef struct {
+    uintptr_t chunk;             /* address >> LIGHT_CHUNK_BITS */
+    _Atomic uint64_t *_Atomic w; /* LIGHT_CHUNK_WORDS words, NULL if unused */
+} light_chunk_t;
+
+typedef struct LIGHTMAP {
+    struct LIGHTMAP *retired; /* directory this one replaced */
+    int bits;
+    size_t used;
+    light_chunk_t dir[];
+} light_map_t;
+
+typedef struct CACHE {
+    alloc_table_t *_Atomic table;
+    light_map_t *_Atomic light; /* blocks left out of the sample */
+    atomic_size_t seq; /* odd while the table or light map changes */
+    atomic_size_t allocated_count;
+    atomic_size_t light_count;   /* live blocks in light */
+    atomic_size_t guard_count;   /* live blocks before a guard page */
+    block_ele_t *_Atomic remote; /* blocks freed by other threads */
+    atomic_size_t remote_count;
+    atomic_size_t readers; /* other threads holding a block found here */
+    atomic_bool in_use;  /* whether a running thread owns it */
+    struct STATS *stats; /* per site, counted by the owning thread */
+    struct CACHE *next;
+} alloc_cache_t;
+
+static alloc_cache_t *_Atomic caches = NULL; /* only ever pushed to */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread alloc_cache_t *cache = NULL;
+
+/* Counters of a cache only ever have one writer at a time, so they are
+ * updated with plain loads and stores. Tables are read with acquire loads
+ * and written with release stores, which order a lookup from another thread
+ * against its check of the sequence count, and cost nothing more on x86.
+ */
+#define load_relaxed(p) atomic_load_explicit(p, memory_order_relaxed)
+#define store_relaxed(p, v) atomic_store_explicit(p, v, memory_order_relaxed)
+#define load_acquire(p) atomic_load_explicit(p, memory_order_acquire)
+#define store_release(p, v) atomic_store_explicit(p, v, memory_order_release)
+
+static inline void count_add(atomic_size_t *n, size_t d)
+{
+    store_relaxed(n, load_relaxed(n) + d);
+}
+
+/* Arena of mmap'd regions that blocks are carved from in arena mode.
+ * Memory is only handed back by arena_reset(), all at once.
+ */
+#define ARENA_REGION_SIZE ((size_t) 64 << 20)
+
+typedef struct REGION {
+    struct REGION *next;
+    size_t size; /* bytes mapped, including this header */
+    size_t used; /* bytes handed out, including this header */
+} arena_region_t;
+
+/* Blocks carved from the arena are preceded by their index in a compact
+ * side table, which takes the place of the hash table in arena mode. The
+ * entry of a freed block is cleared, and the table only grows until the
+ * next reset.
+ */
+typedef struct {
+    size_t index;
+    size_t pad;
+} arena_prefix_t;
+
+#define ARENA_HEADER_SIZE ((sizeof(arena_region_t) + 15) & ~(size_t) 15)
+
+/* All threads share the arena, under arena_lock. The blocks of the side
+ * table are counted in arena_cache, which stands for their owner.
+ */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static alloc_cache_t arena_cache;
+static arena_region_t *arena = NULL;
+static block_ele_t **arena_blocks = NULL;
+static size_t arena_nblocks = 0, arena_capacity = 0;
+static bool arena_mode = false;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Fault injection. Allocations that may fail, those made while the command
+ * of the schedule runs if it names one, are numbered from 1 since the seed
+ * or the schedule was last set. Whether one fails only depends on its
+ * number and the seed, so that a run can be replayed exactly.
+ */
+static uint64_t fault_seed = 0;
+static fault_schedule_t schedule = {0, 0, NULL};
+static atomic_size_t fault_serial = 0;
+
+/* Only one in this many blocks is poisoned and tracked in a table of
+ * blocks. The others are only marked in a light map, carry MAGICLIGHT and
+ * only get canary checks.
+ */
+int sample_interval = 1;
+static __thread size_t sample_serial = 0;
+
+/* Place every sampled block at the end of its own mapping, right before
+ * an inaccessible page, so that an overrun faults on the spot. Such blocks
+ * start with their header at the beginning of the mapping and have no
+ * footer. Their payload is aligned like one from malloc, so an overrun
+ * into the few bytes left before the page is only caught on free. Ignored
+ * in arena mode.
+ */
+int guard_mode = 0;
+static size_t page_size = 0;
+static pthread_once_t page_size_once = PTHREAD_ONCE_INIT;
+
+/* Slot reported by find_header() for blocks left out of the sample */
+#define LIGHT_SLOT ((size_t) -1)
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static atomic_bool error_occurred = false;
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Allocation statistics, per command and call site.
+ * Most allocations are made by a few helpers of the code under test, so
+ * each site also records who called the function making the allocation
+ * when the site was first seen. Finding it takes a walk of the stack,
+ * which is too slow to do for every allocation.
+ * Lifetimes are counted in allocations made in between, so they do not
+ * depend on the speed of the machine. The sites are shared, while each
+ * thread counts the allocations and frees it makes in its own cache.
+ * Threads do not synchronize on the clock, so it may miss ticks while
+ * several of them allocate.
+ */
+#define SITE_TABLE_SIZE 256
+#define LIFE_BUCKETS 64
+
+enum { SITE_EMPTY, SITE_CLAIMED, SITE_READY };
+
+typedef struct {
+    atomic_int state; /* a site is claimed before its key is filled in */
+    char *tag;        /* command running when the blocks were allocated */
+    void *caller;     /* return address of the allocation call */
+    void *via;        /* return address one frame further up */
+} alloc_site_t;
+
+typedef struct STATS {
+    size_t allocs, frees;
+    size_t bytes, freed_bytes;
+    size_t life[LIFE_BUCKETS]; /* frees, by bit length of lifetime */
+} site_stats_t;
+
+static alloc_site_t sites[SITE_TABLE_SIZE];
+static atomic_size_t alloc_clock = 0;
+static size_t stats_epoch = 0; /* alloc_clock at the last reset */
+static char *(*alloc_tagger)() = NULL;
+
+/* Data for managing exceptions, kept by each thread */
+static __thread jmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
+static __thread char *error_message = "";
 
 /* Internal functions */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+/* Finalizer of splitmix64, which turns a counter into a random value */
+static inline uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Should this allocation fail? Return its number if so, 0 otherwise */
+static size_t fail_allocation()
+{
+    if (fail_probability <= 0 && !schedule.nth && !schedule.every)
+        return 0;
+    if (schedule.cmd) {
+        char *tag = alloc_tagger ? alloc_tagger() : NULL;
+        if (!tag || strcmp(tag, schedule.cmd))
+            return 0;
+    }
+
+    size_t n = ++fault_serial;
+    uint64_t weight = mix64(fault_seed + n * 0x9e3779b97f4a7c15ULL) % 100;
+    bool fail = n == schedule.nth ||
+                (schedule.every && n % schedule.every == 0) ||
+                weight < (uint64_t) (fail_probability > 0 ? fail_probability
+                                                          : 0);
+    return fail ? n : 0;
+}
+
+/* Home slot of block b in table t */
+static size_t table_slot(const alloc_table_t *t, block_ele_t *b)
+{
+    return ((size_t) b * 0x9e3779b97f4a7c15ULL) >> (64 - t->bits);
+}
+
+/* Slot holding block b, or the empty slot where it would go. A lookup from
+ * another thread may race with changes to t, so the probe is bounded.
+ */
+static size_t table_find(alloc_table_t *t, block_ele_t *b)
+{
+    size_t mask = ((size_t) 1 << t->bits) - 1;
+    size_t i = table_slot(t, b);
+    for (size_t n = 0; n <= mask; n++) {
+        block_ele_t *e = load_acquire(&t->slot[i]);
+        if (!e || e == b)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Whether table t holds block b, and in which slot */
+static bool table_has(alloc_table_t *t, block_ele_t *b, size_t *slot)
+{
+    if (!t)
+        return false;
+    *slot = table_find(t, b);
+    return load_acquire(&t->slot[*slot]) == b;
+}
+
+/* Changes to the table of cache c are made between these two calls */
+static void write_begin(alloc_cache_t *c)
+{
+    store_relaxed(&c->seq, load_relaxed(&c->seq) + 1);
+}
+
+static void write_end(alloc_cache_t *c)
+{
+    store_release(&c->seq, load_relaxed(&c->seq) + 1);
+}
+
+/* Move every block of cache c into a table of 2^bits slots */
+static void table_rehash(alloc_cache_t *c, int bits)
+{
+    alloc_table_t *old = load_relaxed(&c->table);
+    size_t old_size = old ? (size_t) 1 << old->bits : 0;
+    alloc_table_t *t = calloc(1, sizeof(alloc_table_t) +
+                                     ((size_t) 1 << bits) * sizeof(t->slot[0]));
+    if (!t)
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+    t->retired = old;
+    t->bits = bits;
+    for (size_t i = 0; i < old_size; i++) {
+        block_ele_t *b = load_acquire(&old->slot[i]);
+        if (b)
+            store_release(&t->slot[table_find(t, b)], b);
+    }
+    store_release(&c->table, t);
+}
+
+static void table_insert(alloc_cache_t *c, block_ele_t *b)
+{
+    alloc_table_t *t = load_relaxed(&c->table);
+    size_t count = load_relaxed(&c->allocated_count);
+    write_begin(c);
+    if (!t)
+        table_rehash(c, ALLOC_TABLE_MIN_BITS);
+    else if (2 * (count + 1) > (size_t) 1 << t->bits)
+        table_rehash(c, t->bits + 1);
+    t = load_relaxed(&c->table);
+    store_release(&t->slot[table_find(t, b)], b);
+    store_relaxed(&c->allocated_count, count + 1);
+    write_end(c);
+}
+
+/* Remove the block in slot i, shifting back any block of the same probe
+ * sequence that comes after it so that no lookup stops early.
+ */
+static void table_remove(alloc_cache_t *c, size_t i)
+{
+    alloc_table_t *t = load_relaxed(&c->table);
+    size_t mask = ((size_t) 1 << t->bits) - 1;
+    block_ele_t *b;
+    write_begin(c);
+    for (size_t j = (i + 1) & mask; (b = load_acquire(&t->slot[j]));
+         j = (j + 1) & mask) {
+        size_t k = table_slot(t, b);
+        /* Move it unless its home slot lies cyclically in (i, j] */
+        bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            store_release(&t->slot[i], b);
+            i = j;
+        }
+    }
+    store_release(&t->slot[i], NULL);
+    count_add(&c->allocated_count, -1);
+    write_end(c);
+}
+
+/* Slot of light map m holding the given chunk, or the empty slot where it
+ * would go. A lookup from another thread may race with changes to m, so the
+ * probe is bounded.
+ */
+static size_t light_slot(light_map_t *m, uintptr_t chunk)
+{
+    size_t mask = ((size_t) 1 << m->bits) - 1;
+    size_t i = (chunk * 0x9e3779b97f4a7c15ULL) >> (64 - m->bits);
+    for (size_t n = 0; n <= mask; n++) {
+        if (!load_acquire(&m->dir[i].w) || m->dir[i].chunk == chunk)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Word of light map m holding the bit of block b, which is stored in *bit.
+ * Return NULL if m has no words for the chunk of b.
+ */
+static _Atomic uint64_t *light_word(light_map_t *m,
+                                    block_ele_t *b,
+                                    uint64_t *bit)
+{
+    uintptr_t a = (uintptr_t) b, chunk = a >> LIGHT_CHUNK_BITS;
+    if (!m || a % LIGHT_GRAIN)
+        return NULL;
+    light_chunk_t *e = &m->dir[light_slot(m, chunk)];
+    _Atomic uint64_t *w = load_acquire(&e->w);
+    if (!w || e->chunk != chunk)
+        return NULL;
+    size_t g = (a & (((uintptr_t) 1 << LIGHT_CHUNK_BITS) - 1)) / LIGHT_GRAIN;
+    *bit = (uint64_t) 1 << (g % 64);
+    return &w[g / 64];
+}
+
+/* Whether block b is marked in the light map of cache c */
+static bool light_has(alloc_cache_t *c, block_ele_t *b)
+{
+    uint64_t bit;
+    _Atomic uint64_t *w = light_word(load_acquire(&c->light), b, &bit);
+    return w && (load_relaxed(w) & bit);
+}
+
+/* Give the light map of cache c words for the given chunk */
+static void light_add_chunk(alloc_cache_t *c, uintptr_t chunk)
+{
+    light_map_t *old = load_relaxed(&c->light), *m = old;
+    _Atomic uint64_t *w = calloc(LIGHT_CHUNK_WORDS, sizeof(*w));
+    if (!w)
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+    write_begin(c);
+    if (!m || 2 * (m->used + 1) > (size_t) 1 << m->bits) {
+        int bits = m ? m->bits + 1 : LIGHT_MAP_MIN_BITS;
+        m = calloc(1, sizeof(light_map_t) +
+                          ((size_t) 1 << bits) * sizeof(m->dir[0]));
+        if (!m)
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        m->retired = old;
+        m->bits = bits;
+        for (size_t i = 0; old && i < (size_t) 1 << old->bits; i++) {
+            light_chunk_t *e = &old->dir[i];
+            if (!load_relaxed(&e->w))
+                continue;
+            size_t j = light_slot(m, e->chunk);
+            m->dir[j].chunk = e->chunk;
+            store_release(&m->dir[j].w, load_relaxed(&e->w));
+            m->used++;
+        }
+        store_release(&c->light, m);
+    }
+    size_t i = light_slot(m, chunk);
+    m->dir[i].chunk = chunk;
+    store_release(&m->dir[i].w, w);
+    m->used++;
+    write_end(c);
+}
+
+/* Mark block b in the light map of cache c, which is that of the calling
+ * thread or arena_cache
+ */
+static void light_insert(alloc_cache_t *c, block_ele_t *b)
+{
+    uint64_t bit;
+    _Atomic uint64_t *w = light_word(load_relaxed(&c->light), b, &bit);
+    if (!w) {
+        light_add_chunk(c, (uintptr_t) b >> LIGHT_CHUNK_BITS);
+        w = light_word(load_relaxed(&c->light), b, &bit);
+    }
+    store_relaxed(w, load_relaxed(w) | bit);
+    count_add(&c->light_count, 1);
+}
+
+/* Unmark block b, found in the light map of cache c */
+static void light_remove(alloc_cache_t *c, block_ele_t *b)
+{
+    uint64_t bit;
+    _Atomic uint64_t *w = light_word(load_relaxed(&c->light), b, &bit);
+    store_relaxed(w, load_relaxed(w) & ~bit);
+    count_add(&c->light_count, -1);
+}
+
+#define GUARD_ALIGN _Alignof(max_align_t)
+
+/* Payload size of a guarded block, rounded up to GUARD_ALIGN */
+static size_t guard_round(size_t payload_size)
+{
+    return (payload_size + GUARD_ALIGN - 1) & ~(GUARD_ALIGN - 1);
+}
+
+/* Bytes mapped for a guarded block of the given payload size, not
+ * counting the guard page
+ */
+static size_t guard_span(size_t payload_size)
+{
+    return (sizeof(block_ele_t) + guard_round(payload_size) + page_size - 1) &
+           ~(page_size - 1);
+}
+
+/* Become a reader of cache c, owned by another thread, before looking a
+ * block up in it. The fence pairs with that of readers_wait().
+ */
+static void readers_enter(alloc_cache_t *c)
+{
+    atomic_fetch_add(&c->readers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void readers_leave(alloc_cache_t *c)
+{
+    atomic_fetch_sub(&c->readers, 1);
+}
+
+/* Wait until no other thread can still hold a block just taken off the
+ * table or light map of cache c. Readers coming later cannot find it.
+ * Never called while the calling thread is a reader itself.
+ */
+static void readers_wait(alloc_cache_t *c)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load_explicit(&c->readers, memory_order_acquire))
+        sched_yield();
+}
+
+/* Take the blocks freed by other threads off the table of cache c, and
+ * release them. Only called by the owner of c, or under caches_lock if c
+ * has none.
+ */
+static void cache_drain(alloc_cache_t *c)
+{
+    block_ele_t *first = atomic_exchange(&c->remote, NULL);
+    for (block_ele_t *b = first; b; b = (block_ele_t *) b->birth) {
+        size_t slot;
+        if (table_has(load_relaxed(&c->table), b, &slot))
+            table_remove(c, slot);
+        else if (light_has(c, b))
+            light_remove(c, b);
+    }
+    if (first)
+        readers_wait(c);
+    block_ele_t *b = first;
+    while (b) {
+        block_ele_t *next = (block_ele_t *) b->birth;
+        atomic_fetch_sub(&c->remote_count, 1);
+        if (b->guarded) {
+            munmap(b, guard_span(b->payload_size) + page_size);
+            count_add(&c->guard_count, -1);
+        } else {
+            free(b);
+        }
+        b = next;
+    }
+}
+
+/* Give up the cache of an exiting thread. Once it is marked unused, blocks
+ * freed to it by other threads are released by them, so only those that
+ * came before are left to release here.
+ */
+static void cache_release(void *c)
+{
+    pthread_mutex_lock(&caches_lock);
+    atomic_store(&((alloc_cache_t *) c)->in_use, false);
+    cache_drain(c);
+    pthread_mutex_unlock(&caches_lock);
+}
+
+static void cache_key_create()
+{
+    if (pthread_key_create(&cache_key, cache_release))
+        report_event(MSG_FATAL, "Couldn't set up allocation caches");
+}
+
+/* Cache of the calling thread, taking over one left by an exited thread
+ * if there is any
+ */
+static alloc_cache_t *own_cache()
+{
+    if (cache)
+        return cache;
+
+    pthread_once(&cache_once, cache_key_create);
+    pthread_mutex_lock(&caches_lock);
+    alloc_cache_t *c = caches;
+    while (c && c->in_use)
+        c = c->next;
+    if (!c) {
+        c = calloc(1, sizeof(alloc_cache_t));
+        if (!c)
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        c->stats = calloc(SITE_TABLE_SIZE, sizeof(site_stats_t));
+        if (!c->stats)
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        c->next = caches;
+        caches = c;
+    }
+    c->in_use = true;
+    cache_drain(c);
+    pthread_mutex_unlock(&caches_lock);
+    pthread_setspecific(cache_key, c);
+    cache = c;
+    return c;
+}
+
+/* Whether block b is tracked by cache c, owned by another thread, and if
+ * so whether it is in the light map
+ */
+static bool cache_lookup(alloc_cache_t *c, block_ele_t *b, bool *light)
+{
+    size_t seq, slot;
+    bool found;
+    do {
+        while ((seq = load_acquire(&c->seq)) & 1)
+            sched_yield();
+        found = table_has(load_acquire(&c->table), b, &slot);
+        *light = !found && light_has(c, b);
+    } while (load_relaxed(&c->seq) != seq);
+    return found || *light;
+}
+
+/* Hand block b, claimed from the cache c of another thread, to its owner */
+static void remote_free(alloc_cache_t *c, block_ele_t *b)
+{
+    atomic_fetch_add(&c->remote_count, 1);
+    block_ele_t *head = load_relaxed(&c->remote);
+    do
+        b->birth = (size_t) head;
+    while (!atomic_compare_exchange_weak(&c->remote, &head, b));
+    /* Pushed before checking, so an owner exiting meanwhile drains it */
+    if (c->in_use)
+        return;
+    pthread_mutex_lock(&caches_lock);
+    if (!c->in_use)
+        cache_drain(c);
+    pthread_mutex_unlock(&caches_lock);
+}
+
+/* Sum of the counter at the given offset over all caches */
+static size_t caches_sum(size_t offset)
+{
+    size_t sum = 0;
+    for (alloc_cache_t *c = caches; c; c = c->next)
+        sum += load_relaxed((atomic_size_t *) ((char *) c + offset));
+    return sum;
+}
+
+/* Record block b, carved from the arena, in the side table */
+static void arena_insert(block_ele_t *b)
+{
+    if (arena_nblocks == arena_capacity) {
+        size_t cap = arena_capacity ? 2 * arena_capacity : 1024;
+        block_ele_t **blocks =
+            realloc(arena_blocks, cap * sizeof(block_ele_t *));
+        if (!blocks)
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        arena_blocks = blocks;
+        arena_capacity = cap;
+    }
+    ((arena_prefix_t *) b)[-1].index = arena_nblocks;
+    arena_blocks[arena_nblocks++] = b;
+    count_add(&arena_cache.allocated_count, 1);
+}
+
+/* Whether block b lies in the arena and is live. Its prefix is only read
+ * once b is known to point into a mapped region.
+ */
+static bool arena_find(block_ele_t *b, size_t *slot)
+{
+    for (arena_region_t *r = arena; r; r = r->next) {
+        unsigned char *start = (unsigned char *) r;
+        if ((unsigned char *) b < start + ARENA_HEADER_SIZE +
+                                      sizeof(arena_prefix_t) ||
+            (unsigned char *) b >= start + r->used)
+            continue;
+        *slot = ((arena_prefix_t *) b)[-1].index;
+        return *slot < arena_nblocks && arena_blocks[*slot] == b;
+    }
+    return false;
+}
+
+/* Track block b, in the light map if it was left out of the sample */
+static void alloc_insert(block_ele_t *b, bool light)
+{
+    if (arena_mode) {
+        pthread_mutex_lock(&arena_lock);
+        if (light)
+            light_insert(&arena_cache, b);
+        else
+            arena_insert(b);
+        pthread_mutex_unlock(&arena_lock);
+        return;
+    }
+
+    alloc_cache_t *c = own_cache();
+    if (load_relaxed(&c->remote))
+        cache_drain(c);
+    if (light)
+        light_insert(c, b);
+    else
+        table_insert(c, b);
+}
+
+/* Cache tracking block b, or NULL if b is not currently allocated. The slot
+ * is LIGHT_SLOT if b is in a light map. Otherwise it is only set if b is in
+ * the cache of the calling thread, or in arena_cache, which is returned with
+ * arena_lock held so that b cannot be freed by another thread until
+ * alloc_remove(). The cache of another thread is returned with the calling
+ * thread counted as its reader, until alloc_drop().
+ */
+static alloc_cache_t *alloc_find(block_ele_t *b, size_t *slot)
+{
+    if (arena_mode) {
+        pthread_mutex_lock(&arena_lock);
+        if (arena_find(b, slot))
+            return &arena_cache;
+        if (light_has(&arena_cache, b)) {
+            *slot = LIGHT_SLOT;
+            return &arena_cache;
+        }
+        pthread_mutex_unlock(&arena_lock);
+        return NULL;
+    }
+
+    alloc_cache_t *own = own_cache();
+    if (load_relaxed(&own->remote))
+        cache_drain(own);
+    /* The light map is checked first, as it is much denser than a table */
+    if (load_relaxed(&own->light_count) && light_has(own, b)) {
+        *slot = LIGHT_SLOT;
+        return own;
+    }
+    if (table_has(load_relaxed(&own->table), b, slot))
+        return own;
+    for (alloc_cache_t *c = caches; c; c = c->next) {
+        bool light;
+        if (c == own)
+            continue;
+        readers_enter(c);
+        if (cache_lookup(c, b, &light)) {
+            *slot = light ? LIGHT_SLOT : 0;
+            return c;
+        }
+        readers_leave(c);
+    }
+    return NULL;
+}
+
+/* Give up block b found by alloc_find() in cache c. Unless b has been
+ * claimed, it must not be touched after.
+ */
+static void alloc_drop(alloc_cache_t *c)
+{
+    if (c == &arena_cache)
+        pthread_mutex_unlock(&arena_lock);
+    else if (c != cache)
+        readers_leave(c);
+}
+
+/* Stop tracking block b, in the given slot of cache c, which is that of
+ * the calling thread or arena_cache
+ */
+static void alloc_remove(alloc_cache_t *c, block_ele_t *b, size_t slot)
+{
+    if (slot == LIGHT_SLOT) {
+        light_remove(c, b);
+    } else if (c == &arena_cache) {
+        arena_blocks[slot] = NULL;
+        count_add(&c->allocated_count, -1);
+    } else {
+        table_remove(c, slot);
+    }
+    if (c == &arena_cache)
+        pthread_mutex_unlock(&arena_lock);
+}
+
+/* Payload of the guarded block with header b. Its start is rounded down
+ * to GUARD_ALIGN, which leaves up to GUARD_ALIGN - 1 bytes after it.
+ */
+static void *guard_payload(block_ele_t *b)
+{
+    return (unsigned char *) b + guard_span(b->payload_size) -
+           guard_round(b->payload_size);
+}
+
+/* Whether the bytes between the payload of guarded block b and its guard
+ * page still hold FILLCHAR
+ */
+static bool guard_slack_intact(block_ele_t *b)
+{
+    unsigned char *end = (unsigned char *) guard_payload(b) + b->payload_size;
+    for (size_t i = b->payload_size; i < guard_round(b->payload_size); i++) {
+        if (*end++ != FILLCHAR)
+            return false;
+    }
+    return true;
+}
+
+static void page_size_init(void)
+{
+    page_size = sysconf(_SC_PAGESIZE);
+}
+
+/* Map a block whose payload ends less than GUARD_ALIGN bytes before a
+ * PROT_NONE page.
+ * Return NULL if the mapping cannot be set up.
+ */
+static block_ele_t *guard_alloc(size_t size)
+{
+    pthread_once(&page_size_once, page_size_init);
+    size_t span = guard_span(size);
+    unsigned char *base = mmap(NULL, span + page_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base + span, page_size, PROT_NONE)) {
+        munmap(base, span + page_size);
+        return NULL;
+    }
+    return (block_ele_t *) base;
+}
+
+/* Whether addr lies in the guard page of a live block.
+ * This walks every tracked block, so it is only meant for fault reports.
+ * It is called from a signal handler, so the caches are not locked.
+ */
+bool guard_page_hit(void *addr)
+{
+    if (!caches_sum(offsetof(alloc_cache_t, guard_count)) || arena_mode)
+        return false;
+    for (alloc_cache_t *c = caches; c; c = c->next) {
+        alloc_table_t *t = load_relaxed(&c->table);
+        if (!t)
+            continue;
+        for (size_t i = 0; i < (size_t) 1 << t->bits; i++) {
+            block_ele_t *b = load_relaxed(&t->slot[i]);
+            if (!b || b->magic_header != MAGICGUARD)
+                continue;
+            unsigned char *guard =
+                (unsigned char *) b + guard_span(b->payload_size);
+            if ((unsigned char *) addr >= guard &&
+                (unsigned char *) addr < guard + page_size)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Index of the site for the current command and caller, added if new.
+ * Once the table is full, new sites share the slot they hash to.
+ */
+/* Return address one frame above the one returning to @caller, or NULL if
+ * the stack cannot be walked that far
+ */
+static void *caller_of(void *caller)
+{
+    void *frames[16];
+    int n = backtrace(frames, 16);
+    for (int i = 0; i + 1 < n; i++) {
+        if (frames[i] == caller)
+            return frames[i + 1];
+    }
+    return NULL;
+}
+
+static unsigned int site_find(void *caller)
+{
+    char *tag = alloc_tagger ? alloc_tagger() : NULL;
+    size_t h = ((size_t) tag ^ (size_t) caller) * 0x9e3779b97f4a7c15ULL;
+    unsigned int home = h >> 56, i = home;
+    do {
+        alloc_site_t *site = &sites[i];
+        int state = site->state;
+        if (state == SITE_EMPTY &&
+            atomic_compare_exchange_strong(&site->state, &state,
+                                           SITE_CLAIMED)) {
+            site->tag = tag;
+            site->caller = caller;
+            site->via = caller_of(caller);
+            site->state = SITE_READY;
+            return i;
+        }
+        while (state == SITE_CLAIMED)
+            state = site->state;
+        if (site->tag == tag && site->caller == caller)
+            return i;
+        i = (i + 1) % SITE_TABLE_SIZE;
+    } while (i != home);
+    return home;
+}
+
+/* Tick of the allocation clock, without a locked instruction */
+static size_t clock_tick()
+{
+    size_t now = atomic_load_explicit(&alloc_clock, memory_order_relaxed);
+    atomic_store_explicit(&alloc_clock, now + 1, memory_order_relaxed);
+    return now;
+}
+
+static void site_alloc(block_ele_t *b, void *caller)
+{
+    b->birth = clock_tick();
+    b->site = site_find(caller);
+    site_stats_t *stats = &own_cache()->stats[b->site];
+    stats->allocs++;
+    stats->bytes += b->payload_size;
+}
+
+static void site_free(block_ele_t *b)
+{
+    if (b->birth < stats_epoch)
+        return;
+    site_stats_t *stats = &own_cache()->stats[b->site];
+    size_t now = atomic_load_explicit(&alloc_clock, memory_order_relaxed);
+    /* The tick of its birth may not have reached this thread yet */
+    size_t life = now > b->birth ? now - b->birth : 0;
+    stats->frees++;
+    stats->freed_bytes += b->payload_size;
+    stats->life[life ? 64 - __builtin_clzl(life) : 0]++;
+}
+
+/* Magic number of block b, which another thread may be claiming */
+static inline size_t block_magic(block_ele_t *b)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    return __atomic_load_n(&b->magic_header, __ATOMIC_ACQUIRE);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Find header of block, given its payload, and the cache and slot holding
+ * it as set by alloc_find(). Signal error if doesn't seem like legitimate
+ * block. Return NULL if the block is not currently allocated, so it must not
+ * be touched. Blocks already freed by another thread but not yet released
+ * by their owner count as such.
+ * The block is looked up before any of its memory is read, so that neither
+ * a stray pointer nor a double free touches memory that is not a block.
  */
-static block_ele_t *find_header(void *p)
+static block_ele_t *find_header(void *p, alloc_cache_t **owner, size_t *slot)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
@@ -78,23 +952,39 @@ static block_ele_t *find_header(void *p)
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
+    *owner = alloc_find(b, slot);
+    if (!*owner && caches_sum(offsetof(alloc_cache_t, guard_count))) {
+        /* A guarded block has its header at the start of its mapping, and
+         * its payload begins on the first page of it.
+         */
+        b = (block_ele_t *) ((size_t) b & ~(page_size - 1));
+        *owner = alloc_find(b, slot);
+        if (*owner &&
+            (block_magic(b) != MAGICGUARD || guard_payload(b) != p)) {
+            alloc_drop(*owner);
+            *owner = NULL;
         }
-        if (!found) {
+    }
+    /* Read the magic number once, as another thread may claim the block
+     * in between, which is no corruption
+     */
+    size_t magic = *owner ? block_magic(b) : MAGICFREE;
+    if (*owner && magic == MAGICFREE) {
+        alloc_drop(*owner);
+        *owner = NULL;
+    }
+    if (!*owner) {
+        if (cautious_mode) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
         }
+        return NULL;
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (*slot == LIGHT_SLOT ? magic != MAGICLIGHT
+                            : magic != MAGICHEADER && magic != MAGICGUARD) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -105,6 +995,54 @@ static block_ele_t *find_header(void *p)
     return b;
 }
 
+/* Claim block b, with payload p, to free or move it, so that of two
+ * threads doing so at once only one goes on. Return the magic number it
+ * had, or MAGICFREE if another thread claimed it first, which is reported
+ * in cautious mode.
+ */
+static size_t block_claim(block_ele_t *b, void *p)
+{
+    size_t magic = block_magic(b);
+    while (magic != MAGICFREE &&
+           !__atomic_compare_exchange_n(&b->magic_header, &magic, MAGICFREE,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED))
+        ;
+    if (magic == MAGICFREE && cautious_mode) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+    }
+    return magic;
+}
+
+/* Carve @size bytes from the arena, mapping a new region if needed */
+static void *arena_alloc(size_t size)
+{
+    size = ((size + 15) & ~(size_t) 15) + sizeof(arena_prefix_t);
+    pthread_mutex_lock(&arena_lock);
+    if (!arena || arena->size - arena->used < size) {
+        size_t bytes = ARENA_REGION_SIZE;
+        if (bytes < size + ARENA_HEADER_SIZE)
+            bytes = size + ARENA_HEADER_SIZE;
+        arena_region_t *r = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1, 0);
+        if (r == MAP_FAILED) {
+            pthread_mutex_unlock(&arena_lock);
+            return NULL;
+        }
+        r->size = bytes;
+        r->used = ARENA_HEADER_SIZE;
+        r->next = arena;
+        arena = r;
+    }
+    void *p = (unsigned char *) arena + arena->used + sizeof(arena_prefix_t);
+    arena->used += size;
+    pthread_mutex_unlock(&arena_lock);
+    return p;
+}
+
 /* Given pointer to block, find its footer */
 static size_t *find_footer(block_ele_t *b)
 {
@@ -115,45 +1053,65 @@ static size_t *find_footer(block_ele_t *b)
 
 /* Implementation of application functions */
 
-void *test_malloc(size_t size)
+/* Allocate a block on behalf of the function returning to @caller */
+static void *alloc_block(size_t size, void *caller)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
-    if (fail_allocation()) {
-        report_event(MSG_WARN, "Malloc returning NULL");
+    size_t fault = fail_allocation();
+    if (fault) {
+        report_event(MSG_WARN, "Malloc returning NULL (allocation %lu)", fault);
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+    bool sampled =
+        sample_interval <= 1 || ++sample_serial % sample_interval == 0;
+    if (sampled && guard_mode && !arena_mode) {
+        block_ele_t *new_block = guard_alloc(size);
+        if (new_block) {
+            new_block->magic_header = MAGICGUARD;
+            new_block->guarded = true;
+            new_block->payload_size = size;
+            void *p = guard_payload(new_block);
+            memset(p, FILLCHAR, guard_round(size));
+            alloc_insert(new_block, false);
+            site_alloc(new_block, caller);
+            count_add(&own_cache()->guard_count, 1);
+            return p;
+        }
+        /* Out of mappings, fall back to a block with a footer */
+    }
+
+    size_t bytes = size + sizeof(block_ele_t) + sizeof(size_t);
+    block_ele_t *new_block = arena_mode ? arena_alloc(bytes) : malloc(bytes);
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
+    new_block->magic_header = sampled ? MAGICHEADER : MAGICLIGHT;
+    new_block->guarded = false;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (sampled)
+        memset(p, FILLCHAR, size);
+    alloc_insert(new_block, !sampled);
+    site_alloc(new_block, caller);
 
     return p;
 }
 
+void *test_malloc(size_t size)
+{
+    return alloc_block(size, __builtin_return_address(0));
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -161,7 +1119,7 @@ void *test_calloc(size_t nelem, size_t elsize)
      * https://danluu.com/malloc-tutorial/
      */
     size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
+    void *ptr = alloc_block(size, __builtin_return_address(0));
     memset(ptr, 0, size);
     return ptr;
 }
@@ -176,7 +1134,41 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_ele_t *b = find_header(p);
+    alloc_cache_t *owner;
+    size_t slot;
+    block_ele_t *b = find_header(p, &owner, &slot);
+    if (!b)
+        return;
+    /* The blocks of another thread are released by it */
+    bool remote = owner != &arena_cache && owner != own_cache();
+    if (block_claim(b, p) == MAGICFREE) {
+        alloc_drop(owner);
+        return;
+    }
+    if (remote)
+        alloc_drop(owner);
+    site_free(b);
+    if (b->guarded) {
+        /* Overruns past the slack already faulted, and unmapping catches
+         * later use
+         */
+        if (!guard_slack_intact(b)) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        if (remote) {
+            remote_free(owner, b);
+            return;
+        }
+        alloc_remove(owner, b, slot);
+        readers_wait(owner);
+        munmap(b, guard_span(b->payload_size) + page_size);
+        count_add(&own_cache()->guard_count, -1);
+        return;
+    }
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -185,50 +1177,336 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
-    b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    if (!remote)
+        alloc_remove(owner, b, slot);
+    if (slot != LIGHT_SLOT)
+        memset(p, FILLCHAR, b->payload_size);
+    if (remote) {
+        remote_free(owner, b);
+    } else if (!arena_mode) {
+        readers_wait(owner);
+        free(b);
+    }
+}
 
-    /* Unlink from list */
-    block_ele_t *bn = b->next;
-    block_ele_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+/* Resize a block, keeping its contents.
+ * Blocks from malloc are handed to realloc, which can grow them in place,
+ * and are tracked again wherever they end up. Guarded blocks, blocks
+ * carved from the arena and blocks of another thread are copied into a new
+ * block instead. As with
+ * realloc, the block is left untouched if this fails, and a NULL block
+ * makes it act as test_malloc. A size of 0 gives an empty block rather
+ * than freeing it.
+ */
+void *test_realloc(void *p, size_t size)
+{
+    void *caller = __builtin_return_address(0);
+    if (!p)
+        return alloc_block(size, caller);
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc disallowed");
+        return NULL;
+    }
+
+    alloc_cache_t *owner;
+    size_t slot;
+    block_ele_t *b = find_header(p, &owner, &slot);
+    if (!b)
+        return NULL;
+    size_t old_size = b->payload_size;
+    if (b->guarded || arena_mode || owner != own_cache()) {
+        /* A block of another thread stays claimed while it is copied, so
+         * that its owner cannot release it meanwhile
+         */
+        bool foreign = !arena_mode && owner != own_cache();
+        size_t magic = foreign ? block_claim(b, p) : 0;
+        alloc_drop(owner);
+        if (magic == MAGICFREE)
+            return NULL;
+        void *new_p = alloc_block(size, caller);
+        if (new_p)
+            memcpy(new_p, p, old_size < size ? old_size : size);
+        if (foreign)
+            __atomic_store_n(&b->magic_header, magic, __ATOMIC_RELEASE);
+        if (!new_p)
+            return NULL;
+        test_free(p);
+        return new_p;
+    }
+
+    size_t fault = fail_allocation();
+    if (fault) {
+        report_event(MSG_WARN, "Realloc returning NULL (allocation %lu)",
+                     fault);
+        return NULL;
+    }
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+    size_t magic = block_claim(b, p);
+    if (magic == MAGICFREE)
+        return NULL;
+    site_free(b);
+    alloc_remove(owner, b, slot);
+    readers_wait(owner);
+
+    size_t bytes = size + sizeof(block_ele_t) + sizeof(size_t);
+    block_ele_t *new_block = realloc(b, bytes);
+    if (!new_block) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
 
-    free(b);
-    allocated_count--;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->magic_header = magic;
+    new_block->payload_size = size;
+    *find_footer(new_block) = MAGICFOOTER;
+    if (slot != LIGHT_SLOT && size > old_size)
+        memset(new_block->payload + old_size, FILLCHAR, size - old_size);
+    alloc_insert(new_block, slot == LIGHT_SLOT);
+    site_alloc(new_block, caller);
+    return new_block->payload;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+/* Blocks allocated by all threads. Meant to be called while no other thread
+ * allocates or frees, as the caches are counted one at a time. Blocks freed
+ * by another thread than their owner are not counted, even before the owner
+ * releases them.
+ */
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = caches_sum(offsetof(alloc_cache_t, allocated_count)) -
+                   caches_sum(offsetof(alloc_cache_t, remote_count)) +
+                   caches_sum(offsetof(alloc_cache_t, light_count));
+    pthread_mutex_lock(&arena_lock);
+    count += load_relaxed(&arena_cache.allocated_count) +
+             load_relaxed(&arena_cache.light_count);
+    pthread_mutex_unlock(&arena_lock);
+    return count;
 }
 
 /* Implementation of functions for testing */
 
+void set_alloc_tagger(char *(*tagger)())
+{
+    alloc_tagger = tagger;
+}
+
+void alloc_stats_reset()
+{
+    memset(sites, 0, sizeof(sites));
+    for (alloc_cache_t *c = caches; c; c = c->next)
+        memset(c->stats, 0, SITE_TABLE_SIZE * sizeof(site_stats_t));
+    /* Blocks still allocated are not accounted for when freed */
+    stats_epoch = alloc_clock;
+}
+
+/* Statistics of every thread, summed, for alloc_stats_print() */
+static site_stats_t *site_totals = NULL;
+
+static int cmp_site_bytes(const void *a, const void *b)
+{
+    const site_stats_t *sa = &site_totals[*(const int *) a];
+    const site_stats_t *sb = &site_totals[*(const int *) b];
+    return (sa->bytes < sb->bytes) - (sa->bytes > sb->bytes);
+}
+
+/* Upper bound of lifetime bucket k, such as "<1K" */
+static char *life_bound(int k, char *buf, size_t bufsize)
+{
+    static const char *suffix[] = {"", "K", "M", "G", "T", "P", "E"};
+    if (!k) {
+        snprintf(buf, bufsize, "0");
+        return buf;
+    }
+    snprintf(buf, bufsize, "<%lu%s", 1UL << (k % 10), suffix[k / 10]);
+    return buf;
+}
+
+/* Lifetime bucket below which a share of @num / @den of the frees lie */
+static int life_percentile(const site_stats_t *site, size_t num, size_t den)
+{
+    size_t seen = 0, want = (site->frees * num + den - 1) / den;
+    for (int k = 0; k < LIFE_BUCKETS; k++) {
+        seen += site->life[k];
+        if (seen && seen >= want)
+            return k;
+    }
+    return LIFE_BUCKETS - 1;
+}
+
+/* Describe code address @addr as an offset into its object, for addr2line */
+static char *code_where(void *addr, char *buf, size_t bufsize)
+{
+    Dl_info info;
+    if (!addr) {
+        snprintf(buf, bufsize, "-");
+    } else if (dladdr(addr, &info) && info.dli_fname) {
+        const char *file = strrchr(info.dli_fname, '/');
+        snprintf(buf, bufsize, "%s+%#lx", file ? file + 1 : info.dli_fname,
+                 (unsigned long) ((char *) addr - (char *) info.dli_fbase));
+    } else {
+        snprintf(buf, bufsize, "%p", addr);
+    }
+    return buf;
+}
+
+/* Print a line per command and call site, with the most bytes first.
+ * Call sites and their callers are printed as an offset into their object.
+ * Meant to be called while no other thread allocates or frees.
+ */
+void alloc_stats_print()
+{
+    if (!site_totals)
+        site_totals = calloc(SITE_TABLE_SIZE, sizeof(site_stats_t));
+    if (!site_totals)
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+    memset(site_totals, 0, SITE_TABLE_SIZE * sizeof(site_stats_t));
+    for (alloc_cache_t *c = caches; c; c = c->next) {
+        for (int i = 0; i < SITE_TABLE_SIZE; i++) {
+            site_stats_t *total = &site_totals[i], *stats = &c->stats[i];
+            total->allocs += stats->allocs;
+            total->frees += stats->frees;
+            total->bytes += stats->bytes;
+            total->freed_bytes += stats->freed_bytes;
+            for (int k = 0; k < LIFE_BUCKETS; k++)
+                total->life[k] += stats->life[k];
+        }
+    }
+
+    int order[SITE_TABLE_SIZE], n = 0;
+    for (int i = 0; i < SITE_TABLE_SIZE; i++) {
+        if (sites[i].state == SITE_READY && site_totals[i].allocs)
+            order[n++] = i;
+    }
+    qsort(order, n, sizeof(int), cmp_site_bytes);
+
+    report(1, "%-10s %-18s %-18s %9s %12s %9s %12s  %s", "command",
+           "call site", "called from", "allocs", "bytes", "frees",
+           "live bytes", "lifetime p50 p90 max (allocs)");
+    for (int i = 0; i < n; i++) {
+        alloc_site_t *site = &sites[order[i]];
+        site_stats_t *stats = &site_totals[order[i]];
+        char where[64], via[64], p50[8], p90[8], max[8];
+        if (stats->frees) {
+            life_bound(life_percentile(stats, 1, 2), p50, sizeof(p50));
+            life_bound(life_percentile(stats, 9, 10), p90, sizeof(p90));
+            life_bound(life_percentile(stats, 1, 1), max, sizeof(max));
+        } else {
+            strcpy(p50, "-");
+            strcpy(p90, "-");
+            strcpy(max, "-");
+        }
+        report(1, "%-10s %-18s %-18s %9lu %12lu %9lu %12lu  %4s %4s %4s",
+               site->tag ? site->tag : "-",
+               code_where(site->caller, where, sizeof(where)),
+               code_where(site->via, via, sizeof(via)), stats->allocs,
+               stats->bytes, stats->frees, stats->bytes - stats->freed_bytes,
+               p50, p90, max);
+    }
+}
+
+/* Seed the failures injected with fail_probability, and number allocations
+ * from 1 again
+ */
+void set_fail_seed(unsigned int seed)
+{
+    fault_seed = seed;
+    fault_serial = 0;
+}
+
+/* Replace the schedule of injected failures, and number allocations from 1
+ * again. The command name is copied.
+ */
+void set_fault_schedule(const fault_schedule_t *s)
+{
+    free(schedule.cmd);
+    schedule = *s;
+    if (s->cmd) {
+        schedule.cmd = strdup(s->cmd);
+        if (!schedule.cmd)
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+    }
+    fault_serial = 0;
+}
+
+const fault_schedule_t *get_fault_schedule()
+{
+    return &schedule;
+}
+
+size_t fault_allocations()
+{
+    return fault_serial;
+}
+
 /* Set/unset cautious mode.
- * In this mode, makes extra sure any block to be freed is currently allocated.
+ * In this mode, report any attempt to free a block that is not currently
+ * allocated. Such blocks are never touched, whether or not it is set.
  */
 void set_cautious_mode(bool cautious)
 {
     cautious_mode = cautious;
 }
 
+/* Set/unset arena mode.
+ * In this mode, blocks are carved from large mmap'd regions instead of
+ * coming from malloc, and their memory is only given back by arena_reset().
+ * Blocks keep their canaries and are still tracked one by one.
+ * The mode can only change while no block is allocated.
+ */
+bool set_arena_mode(bool use_arena)
+{
+    if (allocation_check())
+        return false;
+    arena_reset();
+    arena_mode = use_arena;
+    return true;
+}
+
+/* Unmap every region of the arena in one step.
+ * Blocks still allocated are forgotten, and their number is returned so that
+ * they can be reported as leaks. Outside arena mode, nothing is released.
+ */
+size_t arena_reset()
+{
+    size_t leaked = allocation_check();
+    if (!arena_mode)
+        return leaked;
+    store_relaxed(&arena_cache.allocated_count, 0);
+    store_relaxed(&arena_cache.light_count, 0);
+    light_map_t *m = arena_cache.light;
+    for (size_t i = 0; m && i < (size_t) 1 << m->bits; i++) {
+        _Atomic uint64_t *w = load_relaxed(&m->dir[i].w);
+        for (size_t k = 0; w && k < LIGHT_CHUNK_WORDS; k++)
+            store_relaxed(&w[k], 0);
+    }
+    arena_nblocks = 0;
+    while (arena) {
+        arena_region_t *next = arena->next;
+        munmap(arena, arena->size);
+        arena = next;
+    }
+    return leaked;
+}
+
 /* Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
  */
@@ -240,13 +1518,13 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
+ * Each thread has its own exception context, but the time limit is set with
+ * alarm(), which is shared by the whole process.
  */
 bool exception_setup(bool limit_time)
 {
@@ -8,28 +8,90 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ * Blocks can be allocated and freed from any thread. Modes and counts are
+ * meant to be set and read while no other thread is using the harness.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t size);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of blocks allocated by all threads */
 size_t allocation_check();
 
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seed the failures drawn with fail_probability */
+void set_fail_seed(unsigned int seed);
+
+/*
+ * Allocations made while @cmd runs, or all of them if it is NULL, are
+ * numbered from 1 whenever the seed or the schedule is set. On top of those
+ * drawn with fail_probability, allocation number @nth fails, and so does
+ * every allocation whose number is a multiple of @every. Zero turns either
+ * off.
+ */
+typedef struct {
+    size_t nth;
+    size_t every;
+    char *cmd;
+} fault_schedule_t;
+
+void set_fault_schedule(const fault_schedule_t *schedule);
+const fault_schedule_t *get_fault_schedule();
+
+/* Number of allocations that could have been failed so far */
+size_t fault_allocations();
+
+/* Fully check one in this many blocks, the others only get canary checks */
+extern int sample_interval;
+
+/* Put fully checked blocks right before an inaccessible guard page */
+extern int guard_mode;
+
+/* Whether addr lies in the guard page of an allocated block */
+bool guard_page_hit(void *addr);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
 void set_cautious_mode(bool cautious);
 
+/*
+ * Set/unset arena mode.
+ * In this mode, blocks are carved from large mmap'd regions and only given
+ * back all at once by arena_reset(). Fails if any block is allocated.
+ */
+bool set_arena_mode(bool use_arena);
+
+/*
+ * Release the whole arena in one step.
+ * Return the number of blocks that were still allocated, which are leaked.
+ * Outside arena mode, only return that number.
+ */
+size_t arena_reset();
+
+/*
+ * Key allocation statistics by the string tagger returns, as well as by the
+ * return address of the allocation call. Normally the running command.
+ */
+void set_alloc_tagger(char *(*tagger)());
+
+/*
+ * Print allocation counts, bytes and lifetimes per call site, along with the
+ * caller of the function making the allocations
+ */
+void alloc_stats_print();
+
+/* Start allocation statistics over */
+void alloc_stats_reset();
+
 /*
  * Set/unset restricted allocation mode.
  * In this mode, calls to malloc and free are disallowed.
@@ -39,7 +101,7 @@ void set_noallocate_mode(bool noallocate);
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
-/* Prepare for a risky operation using setjmp.
+/* Prepare for a risky operation using setjmp, for the calling thread.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time);
@@ -56,6 +118,7 @@ void trigger_exception(char *msg);
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define free test_free
+#define realloc test_realloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
@@ -2,8 +2,11 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +15,8 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "dudect/complexity.h"
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 
@@ -31,6 +36,7 @@
  * solution code
  */
 #include "queue.h"
+#include "random.h"
 
 #include "console.h"
 #include "report.h"
@@ -41,7 +47,6 @@
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
@@ -66,6 +71,20 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Carve blocks from an arena, see set_arena_mode() */
+static int use_arena = 0;
+
+/* Give queues a slab of elements, see q_set_pool() */
+static int use_pool = 1;
+
+/* Seed of random strings and injected malloc failures */
+static int seed = 0;
+
+/* Sort settings, see q_set_sort_algo() and q_set_sort_threads() */
+static int sort_radix = 0;
+static int sort_threads = 1;
+static int sort_threshold = SORT_THRESHOLD;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -85,12 +104,9 @@ static bool do_free(int argc, char *argv[])
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
 
     l_meta.size = 0;
     l_meta.l = NULL;
@@ -107,6 +123,305 @@ static bool do_free(int argc, char *argv[])
     return ok && !error_check();
 }
 
+static bool do_reset(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (l_meta.l) {
+        report(1, "Queue must be freed before resetting the arena");
+        return false;
+    }
+
+    size_t bcnt = arena_reset();
+    if (bcnt > 0) {
+        report(1, "ERROR: Reset arena, but %lu blocks were still allocated",
+               bcnt);
+        return false;
+    }
+    return !error_check();
+}
+
+/* Stress test of the queue and the harness from several threads.
+ * Each thread first builds a queue of random strings of its own, sorts it,
+ * and checks the order of the first half while removing it. Then fresh
+ * threads free the queue of their neighbour, so that every block is freed
+ * by another thread than the one that allocated it. Last, each thread
+ * allocates as many blocks, and frees them at the same time as the thread
+ * before it does, so that exactly one of two racing frees must go through.
+ */
+#define STRESS_MAX_THREADS 64
+
+typedef struct STRESS {
+    struct list_head *q;
+    struct STRESS *next; /* owner of the queue freed in the second round */
+    int size;
+    unsigned int seed;
+    bool ok;
+    void **blocks; /* freed twice at once in the last round */
+} stress_t;
+
+/* Threads done allocating in the last round, which starts racing once all
+ * of them are. If some thread could not be started, there is no race and
+ * each thread only frees its own blocks.
+ */
+static atomic_int race_ready;
+static atomic_bool race_off;
+static int race_threads;
+
+static void *stress_build(void *arg)
+{
+    stress_t *t = arg;
+    char buf[MAX_RANDSTR_LEN], prev[MAX_RANDSTR_LEN] = "";
+    int inserted = 0;
+
+    t->ok = false;
+    if (exception_setup(false)) {
+        t->q = q_new();
+        /* Injected malloc failures only cut the queue short */
+        for (; t->q && inserted < t->size; inserted++) {
+            size_t len = MIN_RANDSTR_LEN +
+                         rand_r(&t->seed) % (MAX_RANDSTR_LEN - MIN_RANDSTR_LEN);
+            for (size_t n = 0; n < len; n++)
+                buf[n] = charset[rand_r(&t->seed) % (sizeof charset - 1)];
+            buf[len] = '\0';
+            bool rval = inserted % 2 ? q_insert_tail(t->q, buf)
+                                     : q_insert_head(t->q, buf);
+            if (!rval)
+                break;
+        }
+        q_sort(t->q);
+        t->ok = true;
+        for (int i = 0; t->ok && i < inserted / 2; i++) {
+            element_t *e = q_remove_head(t->q, buf, sizeof(buf));
+            t->ok = e && strcmp(prev, buf) <= 0;
+            strcpy(prev, buf);
+            if (e)
+                q_release_element(e);
+        }
+        if (!t->ok)
+            report(1, "ERROR: Sorted queue out of order in stress thread");
+    }
+    exception_cancel();
+    return NULL;
+}
+
+static void *stress_free(void *arg)
+{
+    stress_t *t = arg;
+    if (exception_setup(false))
+        q_free(t->next->q);
+    else
+        t->ok = false;
+    exception_cancel();
+    return NULL;
+}
+
+static void *stress_race(void *arg)
+{
+    stress_t *t = arg;
+    for (int i = 0; i < t->size; i++)
+        t->blocks[i] = test_malloc(1 + rand_r(&t->seed) % 64);
+    atomic_fetch_add(&race_ready, 1);
+    while (race_ready < race_threads && !race_off)
+        sched_yield();
+    for (int i = 0; i < t->size; i++) {
+        test_free(t->blocks[i]);
+        if (!race_off)
+            test_free(t->next->blocks[i]);
+    }
+    return NULL;
+}
+
+/* Run fn on every thread state in its own thread, or inline if no thread
+ * can be started
+ */
+static void stress_round(void *(*fn)(void *), stress_t *threads, int n)
+{
+    pthread_t tids[STRESS_MAX_THREADS];
+    bool started[STRESS_MAX_THREADS];
+    for (int i = 0; i < n; i++) {
+        started[i] = !pthread_create(&tids[i], NULL, fn, &threads[i]);
+        if (!started[i])
+            fn(&threads[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+    }
+}
+
+static bool do_stress(int argc, char *argv[])
+{
+    int nthreads = 4, size = 10000;
+    if (argc > 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc > 1 && (!get_int(argv[1], &nthreads) || nthreads < 1 ||
+                     nthreads > STRESS_MAX_THREADS)) {
+        report(1, "Invalid number of threads '%s', must be 1 to %d", argv[1],
+               STRESS_MAX_THREADS);
+        return false;
+    }
+    if (argc > 2 && (!get_int(argv[2], &size) || size < 0)) {
+        report(1, "Invalid queue size '%s'", argv[2]);
+        return false;
+    }
+
+    size_t bcnt = allocation_check();
+    error_check();
+
+    stress_t threads[STRESS_MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].q = NULL;
+        threads[i].next = &threads[(i + 1) % nthreads];
+        threads[i].size = size;
+        threads[i].seed = prng_next();
+    }
+    stress_round(stress_build, threads, nthreads);
+    stress_round(stress_free, threads, nthreads);
+
+    /* Racing frees that lose are not errors here */
+    pthread_t tids[STRESS_MAX_THREADS];
+    int started = 0;
+    race_ready = 0;
+    race_off = false;
+    race_threads = nthreads;
+    set_cautious_mode(false);
+    for (int i = 0; i < nthreads; i++)
+        threads[i].blocks = calloc_or_fail(size + 1, sizeof(void *), "stress");
+    for (; started < nthreads; started++) {
+        if (pthread_create(&tids[started], NULL, stress_race,
+                           &threads[started]))
+            break;
+    }
+    if (started < nthreads)
+        race_off = true;
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    for (int i = 0; i < nthreads; i++)
+        free_array(threads[i].blocks, size + 1, sizeof(void *));
+    set_cautious_mode(true);
+
+    bool ok = true;
+    for (int i = 0; i < nthreads; i++)
+        ok = ok && threads[i].ok;
+    if (allocation_check() != bcnt) {
+        report(1,
+               "ERROR: Freed stress queues, but %lu blocks are still "
+               "allocated",
+               allocation_check() - bcnt);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+static bool do_fault(int argc, char *argv[])
+{
+    if (argc == 1) {
+        const fault_schedule_t *s = get_fault_schedule();
+        report(1, "Failing allocation %lu, every %lu, in command %s", s->nth,
+               s->every, s->cmd ? s->cmd : "any");
+        report(1, "%lu allocations could have failed so far",
+               fault_allocations());
+        return true;
+    }
+
+    fault_schedule_t s = {0, 0, NULL};
+    if (argc == 2 && !strcmp(argv[1], "off")) {
+        set_fault_schedule(&s);
+        return true;
+    }
+    for (int i = 1; i < argc; i += 2) {
+        int n = 0;
+        bool number = i + 1 < argc && get_int(argv[i + 1], &n) && n >= 0;
+        if (i + 1 < argc && !strcmp(argv[i], "in")) {
+            s.cmd = argv[i + 1];
+        } else if (number && !strcmp(argv[i], "nth")) {
+            s.nth = n;
+        } else if (number && !strcmp(argv[i], "every")) {
+            s.every = n;
+        } else {
+            report(1, "Usage: %s [nth N] [every K] [in CMD] | off", argv[0]);
+            return false;
+        }
+    }
+    set_fault_schedule(&s);
+    return true;
+}
+
+static bool do_allocstats(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+        report(1, "Usage: %s [reset]", argv[0]);
+        return false;
+    }
+
+    if (argc == 2)
+        alloc_stats_reset();
+    else
+        alloc_stats_print();
+    return true;
+}
+
+/* Commands whose complexity can be estimated, with their dudect operations */
+static const struct {
+    char *name;
+    int mode;
+} complexity_cmds[] = {
+    {"ih", test_insert_head}, {"it", test_insert_tail},
+    {"rh", test_remove_head}, {"rt", test_remove_tail},
+    {"size", test_size},      {"dm", test_delete_mid},
+    {"swap", test_swap},      {"reverse", test_reverse},
+    {"sort", test_sort},
+};
+
+/* Names of the complexity classes on the command line */
+static char *complexity_args[complexity_number] = {
+    "1", "logn", "n", "nlogn", "n2",
+};
+
+static bool do_complexity(int argc, char *argv[])
+{
+    size_t ncmds = sizeof(complexity_cmds) / sizeof(complexity_cmds[0]);
+    int mode = -1, expect = -1;
+    if (argc == 2 || argc == 3) {
+        for (size_t i = 0; i < ncmds; i++) {
+            if (!strcmp(argv[1], complexity_cmds[i].name))
+                mode = complexity_cmds[i].mode;
+        }
+    }
+    for (int c = 0; argc == 3 && c < complexity_number; c++) {
+        if (!strcmp(argv[2], complexity_args[c]))
+            expect = c;
+    }
+    if (mode < 0 || (argc == 3 && expect < 0)) {
+        report(1, "Usage: %s CMD [1|logn|n|nlogn|n2]", argv[0]);
+        return false;
+    }
+
+    complexity_fit_t fit;
+    if (!fit_complexity(mode, &fit)) {
+        report(1, "ERROR: Could not time %s", argv[1]);
+        return false;
+    }
+    for (size_t i = 0; i < fit.count; i++)
+        report(2, "%8lu elements: %12.0f cycles", fit.size[i], fit.cycles[i]);
+    for (int c = 0; c < complexity_number; c++)
+        report(2, "%-10s rms %7.2f%%", complexity_names[c], fit.rms[c] * 100);
+    report(1, "%s is %s (rms %.2f%%, noise %.2f%%, margin %.1f)", argv[1],
+           complexity_names[fit.best], fit.rms[fit.best] * 100,
+           fit.noise * 100, fit.margin);
+    if (expect >= 0 && fit.best != expect) {
+        report(1, "ERROR: Expected %s", complexity_names[expect]);
+        return false;
+    }
+    return true;
+}
+
 static bool do_new(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -137,31 +452,102 @@ static bool do_new(int argc, char *argv[])
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    prng_strings(buf, 1, buf_size, MIN_RANDSTR_LEN, buf_size - 1);
+}
 
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[rand() % (sizeof charset - 1)];
-    buf[len] = '\0';
+/* Number of random strings handed to the bulk insert API at once */
+#define BULK_BATCH 1024
+
+/* Insert up to @reps copies of @inserts, or random strings if @need_rand,
+ * with q_insert_head_bulk() or q_insert_tail_bulk(). Stop at the first
+ * batch that fails, so the caller can go on one element at a time.
+ * Return the number of elements inserted.
+ */
+static int insert_bulk(bool at_head, char *inserts, bool need_rand, int reps)
+{
+    static char randstr_bufs[BULK_BATCH][MAX_RANDSTR_LEN];
+    char *strs[BULK_BATCH] = {inserts};
+    int done = 0;
+    while (done < reps) {
+        int n = reps - done, nstr = 1;
+        if (need_rand) {
+            if (n > BULK_BATCH)
+                n = BULK_BATCH;
+            prng_strings(randstr_bufs[0], n, MAX_RANDSTR_LEN, MIN_RANDSTR_LEN,
+                         MAX_RANDSTR_LEN - 1);
+            for (int i = 0; i < n; i++)
+                strs[i] = randstr_bufs[i];
+            nstr = n;
+        }
+        bool rval = at_head ? q_insert_head_bulk(l_meta.l, strs, nstr, n)
+                            : q_insert_tail_bulk(l_meta.l, strs, nstr, n);
+        if (!rval)
+            break;
+        done += n;
+    }
+    lcnt += done;
+    l_meta.size += done;
+    return done;
 }
 
-/* insert head */
-static bool do_ih(int argc, char *argv[])
+/* Check that the @n elements at one end of the queue own separate copies
+ * of the strings inserted, which were copies of @inserts unless random.
+ */
+static bool check_bulk(bool at_head, char *inserts, int n)
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
+    if (!n)
+        return true;
+
+    q_sync(l_meta.l);
+    struct list_head *node = at_head ? l_meta.l->next : l_meta.l->prev;
+    char *lasts = NULL;
+    for (int i = 0; i < n; i++) {
+        char *cur_inserts = list_entry(node, element_t, list)->value;
+        if (!cur_inserts) {
+            report(1, "ERROR: Failed to save copy of string in queue");
             return false;
         }
-        bool ok = is_insert_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
+        if (cur_inserts == inserts) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
             return false;
         }
-        report(1, "Probably constant time");
-        return ok;
+        if (cur_inserts == lasts) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each queue "
+                   "element");
+            return false;
+        }
+        lasts = cur_inserts;
+        node = at_head ? node->next : node->prev;
     }
+    return true;
+}
+
+/* Check that operation @mode, one of the test_* constants of dudect, runs
+ * in constant time. Commands call it instead of running in simulation mode.
+ */
+static bool simulate(int mode, int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    bool ok = is_const(mode);
+    if (!ok) {
+        report(1, "ERROR: Probably not constant time");
+        return false;
+    }
+    report(1, "Probably constant time");
+    return ok;
+}
+
+/* insert head */
+static bool do_ih(int argc, char *argv[])
+{
+    if (simulation)
+        return simulate(test_insert_head, argc, argv);
 
     char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
@@ -190,7 +576,12 @@ static bool do_ih(int argc, char *argv[])
     error_check();
 
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        int r = 0;
+        if (reps > 1) {
+            r = insert_bulk(true, argv[1], need_rand, reps);
+            ok = check_bulk(true, argv[1], r) && !error_check();
+        }
+        for (; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_head(l_meta.l, inserts);
@@ -239,19 +630,8 @@ static bool do_ih(int argc, char *argv[])
 /* insert tail */
 static bool do_it(int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = is_insert_tail_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(test_insert_tail, argc, argv);
 
     char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
@@ -279,7 +659,12 @@ static bool do_it(int argc, char *argv[])
     error_check();
 
     if (exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        int r = 0;
+        if (reps > 1) {
+            r = insert_bulk(false, argv[1], need_rand, reps);
+            ok = check_bulk(false, argv[1], r) && !error_check();
+        }
+        for (; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_tail(l_meta.l, inserts);
@@ -311,28 +696,86 @@ static bool do_it(int argc, char *argv[])
     return ok;
 }
 
-static bool do_remove(int option, int argc, char *argv[])
+/* Append to the value of the head or tail element, then check its end */
+static bool do_append(bool at_tail, int argc, char *argv[])
 {
-    // option 0 is for remove head; option 1 is for remove tail
+    int reps = 1;
+    bool ok = true;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
 
-    /* FIXME: It is known that both functions is_remove_tail_const() and
-     * is_remove_head_const() can not pass dudect on Arm64. We shall figure
-     * out the exact reasons and resolve later.
-     */
-#if !defined(__aarch64__)
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
+    char *appends = argv[1];
+    if (argc == 3) {
+        if (!get_int(argv[2], &reps)) {
+            report(1, "Invalid number of appends '%s'", argv[2]);
             return false;
         }
-        bool ok = option ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling append on null queue");
+    error_check();
+
+    int done = 0;
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            bool rval = at_tail ? q_append_tail(l_meta.l, appends)
+                                : q_append_head(l_meta.l, appends);
+            if (rval) {
+                done++;
+            } else {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Appending %s failed", appends);
+                else {
+                    report(1,
+                           "ERROR: Appending %s failed (%d failures total)",
+                           appends, fail_count);
+                    ok = false;
+                }
+            }
+            ok = ok && !error_check();
         }
-        report(1, "Probably constant time");
-        return ok;
     }
+    exception_cancel();
+
+    if (ok && done) {
+        struct list_head *node = at_tail ? l_meta.l->prev : l_meta.l->next;
+        char *value = list_entry(node, element_t, list)->value;
+        size_t len = strlen(value), alen = strlen(appends);
+        if (len < alen || strcmp(value + len - alen, appends)) {
+            report(1, "ERROR: Appended %s, but value is %s", appends, value);
+            ok = false;
+        }
+    }
+    show_queue(3);
+    return ok;
+}
+
+static bool do_ah(int argc, char *argv[])
+{
+    return do_append(false, argc, argv);
+}
+
+static bool do_at(int argc, char *argv[])
+{
+    return do_append(true, argc, argv);
+}
+
+static bool do_remove(int option, int argc, char *argv[])
+{
+    // option 0 is for remove head; option 1 is for remove tail
+
+    /* FIXME: It is known that both test_remove_tail and test_remove_head
+     * can not pass dudect on Arm64. We shall figure out the exact reasons
+     * and resolve later.
+     */
+#if !defined(__aarch64__)
+    if (simulation)
+        return simulate(option ? test_remove_tail : test_remove_head, argc,
+                        argv);
 #endif
 
     if (argc != 1 && argc != 2) {
@@ -480,17 +923,63 @@ static bool do_rhq(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Entry of the table sorted by find_dups() */
+typedef struct {
+    char *value;
+    size_t idx;
+} dup_ent_t;
+
+static int cmp_dup_ent(const void *a, const void *b)
+{
+    return strcmp(((const dup_ent_t *) a)->value,
+                  ((const dup_ent_t *) b)->value);
+}
+
+/* Flag every element of list l whose string occurs more than once anywhere
+ * in it. Return NULL if out of memory.
+ */
+static bool *find_dups(struct list_head *l, size_t cnt)
+{
+    bool *dup = calloc(cnt + 1, sizeof(bool));
+    dup_ent_t *ents = malloc((cnt + 1) * sizeof(dup_ent_t));
+    if (!dup || !ents) {
+        free(dup);
+        free(ents);
+        return NULL;
+    }
+
+    size_t n = 0;
+    element_t *item;
+    list_for_each_entry (item, l, list) {
+        ents[n].value = item->value;
+        ents[n].idx = n;
+        n++;
+    }
+    qsort(ents, n, sizeof(dup_ent_t), cmp_dup_ent);
+    for (size_t i = 1; i < n; i++) {
+        if (strcmp(ents[i - 1].value, ents[i].value) == 0)
+            dup[ents[i - 1].idx] = dup[ents[i].idx] = true;
+    }
+
+    free(ents);
+    return dup;
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    bool unsorted = argc == 2 && !strcmp(argv[1], "-u");
+    if (argc != 1 && !unsorted) {
+        report(1, "%s takes no arguments other than -u", argv[0]);
         return false;
     }
 
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
+    size_t cnt = 0;
+    bool *dup = NULL;
 
     // Copy l_meta.l to l_copy
+    q_sync(l_meta.l);
     if (l_meta.l && !list_empty(l_meta.l)) {
         list_for_each_entry (item, l_meta.l, list) {
             size_t slen;
@@ -506,9 +995,13 @@ static bool do_dedup(int argc, char *argv[])
             }
             memcpy(tmp->value, item->value, slen);
             list_add_tail(&tmp->list, &l_copy);
+            cnt++;
         }
+        // Without sorting, any two elements may hold the same string
+        if (unsorted && &item->list == l_meta.l)
+            dup = find_dups(&l_copy, cnt);
         // Return false if the loop does not leave properly
-        if (&item->list != l_meta.l) {
+        if (&item->list != l_meta.l || (unsorted && !dup)) {
             list_for_each_entry_safe (item, tmp, &l_copy, list) {
                 free(item->value);
                 free(item);
@@ -522,7 +1015,8 @@ static bool do_dedup(int argc, char *argv[])
 
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_dup(l_meta.l);
+        ok = unsorted ? q_delete_dup_unsorted(l_meta.l)
+                      : q_delete_dup(l_meta.l);
     exception_cancel();
 
     if (!ok) {
@@ -530,12 +1024,32 @@ static bool do_dedup(int argc, char *argv[])
             free(item->value);
             free(item);
         }
-        report(1, "ERROR: Calling delete duplicate on null queue");
+        free(dup);
+        if (!l_meta.l) {
+            report(1, "ERROR: Calling delete duplicate on null queue");
+            return false;
+        }
+        /* Only the unsorted variant allocates, and it leaves the queue
+         * alone when it cannot.
+         */
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Deletion of duplicates failed to allocate");
+            show_queue(3);
+            return !error_check();
+        }
+        report(1,
+               "ERROR: Deletion of duplicates failed to allocate (%d failures "
+               "total)",
+               fail_count);
         return false;
     }
 
+    q_sync(l_meta.l);
+
     struct list_head *l_tmp = l_meta.l->next;
     bool is_this_dup = false;
+    size_t i = 0;
     // Compare between new list and old one
     list_for_each_entry (item, &l_copy, list) {
         // Skip comparison with new list if the string is duplicate
@@ -543,7 +1057,8 @@ static bool do_dedup(int argc, char *argv[])
             item->list.next != &l_copy &&
             strcmp(list_entry(item->list.next, element_t, list)->value,
                    item->value) == 0;
-        if (is_this_dup || is_next_dup) {
+        bool is_dup = unsorted ? dup[i++] : is_this_dup || is_next_dup;
+        if (is_dup) {
             // Update list size
             lcnt--;
             l_meta.size--;
@@ -566,6 +1081,7 @@ static bool do_dedup(int argc, char *argv[])
         free(item->value);
         free(item);
     }
+    free(dup);
 
     show_queue(3);
     return ok && !error_check();
@@ -573,6 +1089,9 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_reverse, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -594,6 +1113,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_size, argc, argv);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -643,6 +1165,9 @@ static bool do_size(int argc, char *argv[])
 
 bool do_sort(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_sort, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -665,6 +1190,7 @@ bool do_sort(int argc, char *argv[])
 
     bool ok = true;
     if (l_meta.size) {
+        q_sync(l_meta.l);
         for (struct list_head *cur_l = l_meta.l->next;
              cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
@@ -686,6 +1212,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_delete_mid, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -707,6 +1236,9 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(test_swap, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -757,6 +1289,7 @@ static bool show_queue(int vlevel)
         return true;
     }
 
+    q_sync(l_meta.l);
     if (!is_circular()) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
@@ -807,10 +1340,115 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
+static void set_use_arena(int oldval)
+{
+    if (!set_arena_mode(use_arena)) {
+        report(1, "Arena mode can only change while no block is allocated");
+        use_arena = oldval;
+    }
+}
+
+static void set_use_pool(int oldval)
+{
+    q_set_pool(use_pool);
+}
+
+static void set_sort_radix(int oldval)
+{
+    q_set_sort_algo(sort_radix ? Q_SORT_RADIX : Q_SORT_MERGE);
+}
+
+static void set_sort_threads(int oldval)
+{
+    if (sort_threads < 1 || sort_threads > SORT_MAX_THREADS) {
+        report(1, "Number of sort threads must be between 1 and %d",
+               SORT_MAX_THREADS);
+        sort_threads = oldval;
+        return;
+    }
+    q_set_sort_threads(sort_threads, sort_threshold);
+}
+
+static void set_seed(int oldval)
+{
+    prng_seed(seed);
+    set_fail_seed(seed);
+}
+
+static void set_sort_threshold(int oldval)
+{
+    q_set_sort_threads(sort_threads, sort_threshold);
+}
+
+static void set_measure(int oldval)
+{
+    if (n_measure <= 2 * drop_size) {
+        report(1, "Measurements per batch must exceed twice the drop size");
+        n_measure = oldval;
+    }
+}
+
+static void set_drop(int oldval)
+{
+    if (drop_size < 0 || n_measure <= 2 * drop_size) {
+        report(1, "Drop size must be between 0 and half the batch size");
+        drop_size = oldval;
+    }
+}
+
+static void set_enough(int oldval)
+{
+    if (enough_measure < 1) {
+        report(1, "Measurements needed must be positive");
+        enough_measure = oldval;
+    }
+}
+
+static void set_tries(int oldval)
+{
+    if (test_tries < 1) {
+        report(1, "Number of tries must be positive");
+        test_tries = oldval;
+    }
+}
+
+static void set_counter(int oldval)
+{
+    if (cycle_counter < counter_tsc || cycle_counter > counter_instructions) {
+        report(1, "Counter must be 0 (time stamps), 1 (serialized time "
+                  "stamps), 2 (cycles) or 3 (instructions)");
+        cycle_counter = oldval;
+    }
+}
+
+static void set_pin_cpu(int oldval)
+{
+    if (pin_cpu < -1) {
+        report(1, "CPU must be -1 (don't pin) or a CPU number");
+        pin_cpu = oldval;
+    }
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "                | Create new queue");
     ADD_COMMAND(free, "                | Delete queue");
+    ADD_COMMAND(reset,
+                "                | Release the allocation arena at once");
+    ADD_COMMAND(stress,
+                " [t] [n]        | Build, sort and free queues of n strings "
+                "on t threads at once, then free n blocks each from two "
+                "threads at once (default: t == 4, n == 10000)");
+    ADD_COMMAND(fault,
+                " [schedule]     | Fail malloc number N (nth N) and every "
+                "Kth (every K), counting only in CMD (in CMD), or stop (off). "
+                "Show the schedule if none given");
+    ADD_COMMAND(allocstats,
+                " [reset]        | Show or clear allocations per call site");
+    ADD_COMMAND(complexity,
+                " cmd [class]    | Fit the running time of cmd over growing "
+                "queues to O(1), O(log n), O(n), O(n log n) or O(n^2), and "
+                "check it against class (1, logn, n, nlogn or n2)");
     ADD_COMMAND(
         ih,
         " str [n]        | Insert string str at head of queue n times. "
@@ -819,6 +1457,12 @@ static void console_init()
         it,
         " str [n]        | Insert string str at tail of queue n times. "
         "Generate random string(s) if str equals RAND. (default: n == 1)");
+    ADD_COMMAND(ah,
+                " str [n]        | Append string str to the value at head of "
+                "queue n times (default: n == 1)");
+    ADD_COMMAND(at,
+                " str [n]        | Append string str to the value at tail of "
+                "queue n times (default: n == 1)");
     ADD_COMMAND(
         rh,
         " [str]          | Remove from head of queue.  Optionally compare "
@@ -836,24 +1480,74 @@ static void console_init()
         size, " [n]            | Compute queue size n times (default: n == 1)");
     ADD_COMMAND(show, "                | Show queue contents");
     ADD_COMMAND(dm, "                | Delete middle node in queue");
-    ADD_COMMAND(
-        dedup, "                | Delete all nodes that have duplicate string");
+    ADD_COMMAND(dedup,
+                " [-u]           | Delete all nodes that have duplicate "
+                "string. With -u, the queue need not be sorted");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("seed", &seed, "Seed of random strings and malloc failures",
+              set_seed);
+    add_param("sample", &sample_interval,
+              "Poison and track one in this many blocks", NULL);
+    add_param("guard", &guard_mode,
+              "Do/don't put tracked blocks before a guard page", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("arena", &use_arena, "Do/don't carve blocks from an arena",
+              set_use_arena);
+    add_param("pool", &use_pool,
+              "Do/don't carve elements of new queues from a slab",
+              set_use_pool);
+    add_param("radix", &sort_radix, "Do/don't sort with MSD radix sort",
+              set_sort_radix);
+    add_param("threads", &sort_threads, "Number of threads used by sort",
+              set_sort_threads);
+    add_param("threshold", &sort_threshold,
+              "Minimum queue size for sorting on several threads",
+              set_sort_threshold);
+    add_param("measure", &n_measure,
+              "Number of measurements per constant-time test batch",
+              set_measure);
+    add_param("drop", &drop_size,
+              "Measurements left out at either end of a batch", set_drop);
+    add_param("enough", &enough_measure,
+              "Measurements needed for a constant-time verdict", set_enough);
+    add_param("tries", &test_tries,
+              "Attempts before deeming an operation variable time",
+              set_tries);
+    add_param("counter", &cycle_counter,
+              "Measure with time stamps (0), serialized time stamps (1, the "
+              "default), or perf cycles (2) or instructions (3)",
+              set_counter);
+    add_param("cpu", &pin_cpu, "CPU to pin measurements to (-1: don't pin)",
+              set_pin_cpu);
+    add_param("sequential", &sequential_stop,
+              "Do/don't end constant-time attempts once the outcome is clear",
+              NULL);
 }
 
 /* Signal handlers */
-static void sigsegvhandler(int sig)
+static void sigsegvhandler(int sig, siginfo_t *info, void *ucontext)
 {
-    report(1,
-           "Segmentation fault occurred.  You dereferenced a NULL or invalid "
-           "pointer");
+    char *cmd = current_cmd();
+    if (guard_page_hit(info->si_addr))
+        report(1,
+               "Segmentation fault occurred.  Command '%s' accessed %p, past "
+               "the end of an allocated block",
+               cmd ? cmd : "", info->si_addr);
+    else if (cmd)
+        report(1,
+               "Segmentation fault occurred in command '%s'.  You "
+               "dereferenced a NULL or invalid pointer",
+               cmd);
+    else
+        report(1,
+               "Segmentation fault occurred.  You dereferenced a NULL or "
+               "invalid pointer");
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -869,20 +1563,19 @@ static void queue_init()
 {
     fail_count = 0;
     l_meta.l = NULL;
-    signal(SIGSEGV, sigsegvhandler);
+    struct sigaction sa = {.sa_sigaction = sigsegvhandler,
+                           .sa_flags = SA_SIGINFO};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrmhandler);
 }
 
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -896,11 +1589,13 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-e ENGINE]\n",
+           cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-e ENGINE  Back queues with 'list' (default) or 'ring'\n");
     exit(0);
 }
 
@@ -952,7 +1647,7 @@ int main(int argc, char *argv[])
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:e:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -977,6 +1672,16 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'e':
+            if (!strcmp(optarg, "list")) {
+                q_set_engine(Q_ENGINE_LIST);
+            } else if (!strcmp(optarg, "ring")) {
+                q_set_engine(Q_ENGINE_RING);
+            } else {
+                fprintf(stderr, "Unknown queue engine '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -984,10 +1689,12 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    seed = (int) time(NULL);
+    set_seed(0);
     queue_init();
     init_cmd();
     console_init();
+    set_alloc_tagger(current_cmd);
 
     /* Initialize linenoise only when infile_name not exist */
     if (!infile_name) {
@@ -1,3 +1,6 @@
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,16 +13,681 @@
  *   cppcheck-suppress nullPointer
  */
 
+/* Element cells are carved from chunks that start at one page and double
+ * in size up to POOL_CHUNK_SIZE << POOL_MAX_SHIFT, so refills become rare
+ * as the queue grows.
+ */
+#define POOL_CHUNK_SIZE 4096
+#define POOL_MAX_SHIFT 6
+
+typedef struct pool_chunk {
+    struct pool_chunk *next;
+    size_t ncells;
+    element_t cells[];
+} pool_chunk_t;
+
+/* Per-queue slab of element cells.
+ * Cells are handed out from the newest chunk first and recycled through a
+ * free list linked by their list.next pointers. Chunks go back to the
+ * allocator only after the queue is freed and every cell handed out has
+ * been released, so leaked elements still show up in allocation_check().
+ */
+struct q_pool {
+    pool_chunk_t *chunks;
+    struct list_head *free_cells;
+    size_t unused; /* cells never handed out in the newest chunk */
+    size_t live;   /* cells handed out and not yet released */
+    int shift;     /* size of the next chunk, in pages, as a power of two */
+    bool orphaned; /* the owning queue has been freed */
+    bool single;   /* cells are allocated one at a time, see q_set_pool() */
+};
+
+typedef struct q_ops q_ops_t;
+
+/* Half of a queue backed by the ring engine: a power-of-two array of
+ * element pointers used as a double-ended queue.
+ */
+typedef struct {
+    element_t **slot;
+    unsigned int mask;  /* capacity minus one */
+    unsigned int first; /* position of the first element in @slot */
+    int size;
+} ring_half_t;
+
+/* Queue descriptor.
+ * Callers only ever see &q->head, so every operation can reach the cached
+ * element count with container_of() instead of walking the list.
+ *
+ * Everything that depends on how the elements are kept goes through @ops.
+ * Queues backed by the ring engine keep their elements in @half, see
+ * ring_at(). Their list head always points at the first and last element,
+ * but the links between elements are only brought up to date by q_sync().
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    struct q_pool pool;
+    const q_ops_t *ops;
+    /* Ring engine only: the first size / 2 elements, then the others */
+    ring_half_t half[2];
+    /* Elements [linked_off, linked_off + linked_cnt) are chained in order */
+    int linked_off, linked_cnt;
+} queue_t;
+
+/* Queue engine.
+ * The q_* functions check their arguments, call into the engine of the
+ * queue and then update the cached size, so engines see @size as it was
+ * before the operation. Operations that rearrange the whole queue do so on
+ * the list links, between a call to link() and one to gather().
+ */
+struct q_ops {
+    bool (*init)(queue_t *q);
+    void (*destroy)(queue_t *q);
+    /* Make room for @n more elements, after which adding cannot fail */
+    bool (*reserve)(queue_t *q, int n);
+    void (*add)(queue_t *q, element_t *e, bool at_tail);
+    /* Add the elements chained on @batch, keeping their order */
+    void (*splice)(queue_t *q, struct list_head *batch, bool at_tail);
+    element_t *(*end)(queue_t *q, bool at_tail);
+    element_t *(*remove)(queue_t *q, bool at_tail);
+    element_t *(*remove_mid)(queue_t *q);
+    /* Bring the list links up to date */
+    void (*link)(queue_t *q);
+    /* Adopt the order of the list links after they were rearranged */
+    void (*gather)(queue_t *q);
+};
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return list_entry(head, queue_t, head);
+}
+
+/* Engine used by q_new() */
+static q_engine_t engine = Q_ENGINE_LIST;
+
+/* Whether q_new() gives queues a slab, see q_set_pool() */
+static bool use_pool = true;
+
+/* Release every chunk of the pool along with the queue owning it */
+static void pool_destroy(struct q_pool *pool)
+{
+    pool_chunk_t *chunk = pool->chunks;
+    while (chunk) {
+        pool_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(list_entry(pool, queue_t, pool));
+}
+
+/* Add a chunk of at least @want cells to the pool */
+static bool pool_grow(struct q_pool *pool, size_t want)
+{
+    size_t bytes = (size_t) POOL_CHUNK_SIZE << pool->shift;
+    if (bytes < sizeof(pool_chunk_t) + want * sizeof(element_t)) {
+        bytes = sizeof(pool_chunk_t) + want * sizeof(element_t);
+    }
+    pool_chunk_t *chunk = malloc(bytes);
+    if (chunk == NULL) {
+        return false;
+    }
+    chunk->ncells = (bytes - sizeof(pool_chunk_t)) / sizeof(element_t);
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->unused = chunk->ncells;
+    if (pool->shift < POOL_MAX_SHIFT) {
+        pool->shift++;
+    }
+    return true;
+}
+
+/* Hand out a cell. When a chunk has to be added, it is sized for @want
+ * cells, so a bulk insert needs a single allocation.
+ */
+static element_t *pool_alloc(struct q_pool *pool, size_t want)
+{
+    element_t *e;
+    if (pool->single) {
+        e = malloc(sizeof(element_t));
+        if (e == NULL) {
+            return NULL;
+        }
+    } else if (pool->free_cells) {
+        e = list_entry(pool->free_cells, element_t, list);
+        pool->free_cells = e->list.next;
+    } else {
+        if (!pool->unused && !pool_grow(pool, want)) {
+            return NULL;
+        }
+        e = &pool->chunks->cells[pool->chunks->ncells - pool->unused--];
+    }
+    e->pool = pool;
+    pool->live++;
+    return e;
+}
+
+static void pool_free(element_t *e)
+{
+    struct q_pool *pool = e->pool;
+    if (pool->single) {
+        free(e);
+    } else {
+        e->list.next = pool->free_cells;
+        pool->free_cells = &e->list;
+    }
+    if (--pool->live == 0 && pool->orphaned) {
+        pool_destroy(pool);
+    }
+}
+
+/* Build with QSIZE_DEBUG defined to compare the cached element count with
+ * a full walk after every operation that changes the queue.
+ */
+#ifdef QSIZE_DEBUG
+static void q_check_size(struct list_head *head)
+{
+    int count = 0;
+    struct list_head *node;
+    to_queue(head)->ops->link(to_queue(head));
+    list_for_each (node, head) {
+        count++;
+    }
+    if (count != to_queue(head)->size) {
+        fprintf(stderr, "queue: cached size %d, but list holds %d elements\n",
+                to_queue(head)->size, count);
+        assert(0);
+    }
+}
+#else
+#define q_check_size(head) ((void) (head))
+#endif
+
+/* List engine.
+ * Elements are chained through their list links at all times.
+ */
+static bool chain_init(queue_t *q)
+{
+    return true;
+}
+
+/* Nothing to release, reserve or bring up to date */
+static void chain_nop(queue_t *q) {}
+
+static bool chain_reserve(queue_t *q, int n)
+{
+    return true;
+}
+
+static void chain_add(queue_t *q, element_t *e, bool at_tail)
+{
+    if (at_tail) {
+        list_add_tail(&e->list, &q->head);
+    } else {
+        list_add(&e->list, &q->head);
+    }
+}
+
+static void chain_splice(queue_t *q, struct list_head *batch, bool at_tail)
+{
+    if (at_tail) {
+        list_splice_tail(batch, &q->head);
+    } else {
+        list_splice(batch, &q->head);
+    }
+}
+
+static element_t *chain_end(queue_t *q, bool at_tail)
+{
+    return at_tail ? list_last_entry(&q->head, element_t, list)
+                   : list_first_entry(&q->head, element_t, list);
+}
+
+static element_t *chain_remove(queue_t *q, bool at_tail)
+{
+    element_t *e = chain_end(q, at_tail);
+    list_del_init(&e->list);
+    return e;
+}
+
+/* The size is known, so walking back from the tail covers at most half of
+ * the queue, instead of the 1.5 passes of the fast/slow pointers.
+ */
+static element_t *chain_remove_mid(queue_t *q)
+{
+    struct list_head *node = q->head.prev;
+    for (int i = q->size - 1; i > q->size / 2; i--)
+        node = node->prev;
+    list_del_init(node);
+    return list_entry(node, element_t, list);
+}
+
+static const q_ops_t list_ops = {
+    .init = chain_init,
+    .destroy = chain_nop,
+    .reserve = chain_reserve,
+    .add = chain_add,
+    .splice = chain_splice,
+    .end = chain_end,
+    .remove = chain_remove,
+    .remove_mid = chain_remove_mid,
+    .link = chain_nop,
+    .gather = chain_nop,
+};
+
+/* Ring engine.
+ * Element pointers live in two power-of-two arrays used as double-ended
+ * queues: half[0] holds the first size / 2 elements and half[1] the others.
+ * Operations at either end never touch a neighbouring element, and the
+ * middle element is always the first of half[1]. Every change moves at most
+ * one element across the middle to keep it there.
+ */
+#define RING_INIT_SIZE 32
+
+static inline element_t **half_at(ring_half_t *h, int i)
+{
+    return &h->slot[(h->first + i) & h->mask];
+}
+
+/* Slot of the element at index @i of the queue */
+static inline element_t **ring_at(queue_t *q, int i)
+{
+    ring_half_t *h = &q->half[0];
+    if (i >= h->size) {
+        i -= h->size;
+        h++;
+    }
+    return half_at(h, i);
+}
+
+static inline int ring_count(queue_t *q)
+{
+    return q->half[0].size + q->half[1].size;
+}
+
+/* Move the elements of @h into a new array of @cap slots, starting at 0 */
+static bool half_resize(ring_half_t *h, unsigned int cap)
+{
+    element_t **slot = malloc(cap * sizeof(element_t *));
+    if (slot == NULL) {
+        return false;
+    }
+    for (int i = 0; i < h->size; i++) {
+        slot[i] = *half_at(h, i);
+    }
+    free(h->slot);
+    h->slot = slot;
+    h->mask = cap - 1;
+    h->first = 0;
+    return true;
+}
+
+/* The array must have room, see ring_reserve() */
+static inline void half_push(ring_half_t *h, element_t *e, bool at_tail)
+{
+    if (at_tail) {
+        *half_at(h, h->size) = e;
+    } else {
+        h->first--;
+        *half_at(h, 0) = e;
+    }
+    h->size++;
+}
+
+static inline element_t *half_pop(ring_half_t *h, bool at_tail)
+{
+    element_t *e;
+    if (at_tail) {
+        e = *half_at(h, h->size - 1);
+    } else {
+        e = *half_at(h, 0);
+        h->first++;
+    }
+    h->size--;
+    return e;
+}
+
+/* Move one element across the middle if a change left half[0] with more or
+ * fewer than size / 2 elements. The order of the queue stays the same.
+ */
+static void ring_balance(queue_t *q)
+{
+    ring_half_t *front = &q->half[0], *back = &q->half[1];
+    int want = ring_count(q) / 2;
+    if (front->size > want) {
+        half_push(back, half_pop(front, true), false);
+    } else if (front->size < want) {
+        half_push(front, half_pop(back, false), true);
+    }
+}
+
+/* Point the list head at the first and last element, which is all that
+ * callers peeking at either end look at.
+ */
+static void ring_ends(queue_t *q)
+{
+    int n = ring_count(q);
+    if (!n) {
+        INIT_LIST_HEAD(&q->head);
+        return;
+    }
+    q->head.next = &(*ring_at(q, 0))->list;
+    q->head.prev = &(*ring_at(q, n - 1))->list;
+}
+
+static inline void link_after(element_t *prev, element_t *e)
+{
+    prev->list.next = &e->list;
+    e->list.prev = &prev->list;
+}
+
+/* Shrink the chained range before the element at @i is taken out. Its
+ * neighbours are linked to each other if both stay inside the range.
+ */
+static void ring_unchain(queue_t *q, int i)
+{
+    int lo = q->linked_off, hi = q->linked_off + q->linked_cnt;
+    if (i < lo) {
+        q->linked_off--;
+    } else if (i < hi) {
+        if (i > lo && i < hi - 1) {
+            link_after(*ring_at(q, i - 1), *ring_at(q, i + 1));
+        }
+        q->linked_cnt--;
+    }
+    if (!q->linked_cnt) {
+        q->linked_off = 0;
+    }
+}
+
+static bool ring_init(queue_t *q)
+{
+    for (int k = 0; k < 2; k++) {
+        q->half[k].slot = NULL;
+        q->half[k].size = 0;
+        if (!half_resize(&q->half[k], RING_INIT_SIZE)) {
+            free(q->half[0].slot);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ring_destroy(queue_t *q)
+{
+    free(q->half[0].slot);
+    free(q->half[1].slot);
+}
+
+/* Either half may end up one element above its share while a change is
+ * being balanced, so both get room for half of the elements plus one.
+ */
+static bool ring_reserve(queue_t *q, int n)
+{
+    unsigned int need = (q->size + n + 1) / 2 + 1;
+    for (int k = 0; k < 2; k++) {
+        unsigned int cap = q->half[k].mask + 1;
+        if (cap >= need) {
+            continue;
+        }
+        while (cap < need) {
+            cap <<= 1;
+        }
+        if (!half_resize(&q->half[k], cap)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ring_add(queue_t *q, element_t *e, bool at_tail)
+{
+    half_push(&q->half[at_tail], e, at_tail);
+    if (!at_tail && q->linked_cnt) {
+        q->linked_off++;
+    }
+    ring_balance(q);
+    ring_ends(q);
+}
+
+static void ring_splice(queue_t *q, struct list_head *batch, bool at_tail)
+{
+    struct list_head *node = at_tail ? batch->next : batch->prev;
+    while (node != batch) {
+        struct list_head *next = at_tail ? node->next : node->prev;
+        ring_add(q, list_entry(node, element_t, list), at_tail);
+        node = next;
+    }
+}
+
+static element_t *ring_end(queue_t *q, bool at_tail)
+{
+    return *ring_at(q, at_tail ? q->size - 1 : 0);
+}
+
+/* Take the element at one end of @h out of the queue */
+static element_t *ring_pop(queue_t *q, ring_half_t *h, bool at_tail)
+{
+    element_t *e = half_pop(h, at_tail);
+    ring_balance(q);
+    ring_ends(q);
+    INIT_LIST_HEAD(&e->list);
+    return e;
+}
+
+static element_t *ring_remove(queue_t *q, bool at_tail)
+{
+    /* half[0] is empty when the queue holds a single element */
+    ring_half_t *h = &q->half[at_tail || !q->half[0].size];
+    ring_unchain(q, at_tail ? q->size - 1 : 0);
+    return ring_pop(q, h, at_tail);
+}
+
+static element_t *ring_remove_mid(queue_t *q)
+{
+    ring_unchain(q, q->size / 2);
+    return ring_pop(q, &q->half[1], false);
+}
+
+/* Chain the elements in ring order and hook them up to the list head.
+ * Only the elements outside the range that is already chained are touched.
+ */
+static void ring_link(queue_t *q)
+{
+    struct list_head *head = &q->head;
+    if (!q->size) {
+        INIT_LIST_HEAD(head);
+        return;
+    }
+
+    int lo = q->linked_off, hi = q->linked_off + q->linked_cnt;
+    if (!q->linked_cnt) {
+        lo = 0;
+        hi = 1;
+    }
+    for (int i = lo - 1; i >= 0; i--) {
+        link_after(*ring_at(q, i), *ring_at(q, i + 1));
+    }
+    for (int i = hi; i < q->size; i++) {
+        link_after(*ring_at(q, i - 1), *ring_at(q, i));
+    }
+
+    element_t *first = *ring_at(q, 0), *last = *ring_at(q, q->size - 1);
+    head->next = &first->list;
+    first->list.prev = head;
+    head->prev = &last->list;
+    last->list.next = head;
+    q->linked_off = 0;
+    q->linked_cnt = q->size;
+}
+
+/* Refill the arrays from the list links. The queue has not grown since it
+ * was last balanced, so both halves have room.
+ */
+static void ring_gather(queue_t *q)
+{
+    ring_half_t *h = &q->half[0];
+    q->half[0].first = q->half[1].first = 0;
+    q->half[0].size = q->half[1].size = 0;
+    int i = 0;
+    struct list_head *node;
+    list_for_each (node, &q->head) {
+        if (i++ == q->size / 2) {
+            h = &q->half[1];
+        }
+        h->slot[h->size++] = list_entry(node, element_t, list);
+    }
+    q->linked_off = 0;
+    q->linked_cnt = q->size;
+}
+
+static const q_ops_t ring_ops = {
+    .init = ring_init,
+    .destroy = ring_destroy,
+    .reserve = ring_reserve,
+    .add = ring_add,
+    .splice = ring_splice,
+    .end = ring_end,
+    .remove = ring_remove,
+    .remove_mid = ring_remove_mid,
+    .link = ring_link,
+    .gather = ring_gather,
+};
+
+/* Select the engine of queues created from now on */
+void q_set_engine(q_engine_t e)
+{
+    engine = e;
+}
+
+/* Select whether queues created from now on use a slab */
+void q_set_pool(bool on)
+{
+    use_pool = on;
+}
 
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    if (head == NULL) {
+    queue_t *q = malloc(sizeof(queue_t));
+    if (q == NULL) {
         return NULL;
     }
-    INIT_LIST_HEAD(head);
-    return head;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->pool.chunks = NULL;
+    q->pool.free_cells = NULL;
+    q->pool.unused = 0;
+    q->pool.live = 0;
+    q->pool.shift = 0;
+    q->pool.orphaned = false;
+    q->pool.single = !use_pool;
+    q->ops = engine == Q_ENGINE_RING ? &ring_ops : &list_ops;
+    q->linked_off = 0;
+    q->linked_cnt = 0;
+
+    /* Fill the first chunk up front, so inserting into an empty queue costs
+     * the same as inserting into any other.
+     */
+    if (!q->pool.single && !pool_grow(&q->pool, 0)) {
+        free(q);
+        return NULL;
+    }
+    if (!q->ops->init(q)) {
+        pool_destroy(&q->pool);
+        return NULL;
+    }
+    return &q->head;
+}
+
+/* Out-of-line strings are preceded by a pointer to the block they were
+ * carved from by a bulk insert, or by NULL if they were allocated on their
+ * own. A block goes away with the last string it holds.
+ * Strings allocated on their own also record their length and the room
+ * they have, so that appends can grow them geometrically.
+ */
+typedef struct {
+    size_t refs;
+} str_block_t;
+
+typedef struct {
+    size_t length;      /* of the string, not counting its terminator */
+    size_t room;        /* bytes available for the string */
+    str_block_t *owner; /* always NULL, right before the string */
+} value_head_t;
+
+static inline value_head_t *value_head(char *value)
+{
+    return (value_head_t *) value - 1;
+}
+
+/* Room taken in a block by a string of @len bytes and its owner pointer */
+static inline size_t str_block_room(size_t len)
+{
+    return sizeof(str_block_t *) + ((len + 7) & ~(size_t) 7);
+}
+
+/* Allocate storage for a string of @len bytes, owned by no block */
+static inline char *value_alloc(size_t len)
+{
+    value_head_t *h = malloc(sizeof(*h) + len);
+    if (h == NULL) {
+        return NULL;
+    }
+    h->length = len - 1;
+    h->room = len;
+    h->owner = NULL;
+    return (char *) (h + 1);
+}
+
+/* Free the string of @e unless it is stored inline */
+static inline void release_value(element_t *e)
+{
+    if (e->value == e->inline_value) {
+        return;
+    }
+    str_block_t **owner = (str_block_t **) e->value - 1;
+    if (*owner == NULL) {
+        free(value_head(e->value));
+    } else if (--(*owner)->refs == 0) {
+        free(*owner);
+    }
+}
+
+/* Whether a string of @len bytes, terminator included, is stored inline in
+ * an element from @pool. Queues without a slab keep every string apart, so
+ * that each one is a block of its own to the allocator.
+ */
+static inline bool fits_inline(const struct q_pool *pool, size_t len)
+{
+    return len <= ELEMENT_INLINE_SIZE && !pool->single;
+}
+
+/* Pack the first 8 bytes of @s into an integer that sorts like the string */
+static inline uint64_t key_prefix(const char *s)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*s) {
+            key |= (unsigned char) *s++;
+        }
+    }
+    return key;
+}
+
+/* Compare two elements like strcmp() on their values.
+ * strcmp() only runs when the cached prefixes are equal and the strings go
+ * on past them.
+ */
+static inline int cmp_element(const element_t *a, const element_t *b)
+{
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    if (!(a->key & 0xff)) {
+        return 0;
+    }
+    return strcmp(a->value + 8, b->value + 8);
 }
 
 /* Free all storage used by queue */
@@ -28,121 +696,342 @@ void q_free(struct list_head *l)
     if (l == NULL) {
         return;
     }
+    queue_t *q = to_queue(l);
+    q->ops->link(q);
     element_t *node, *safe;
     list_for_each_entry_safe (node, safe, l, list) {
-        list_del_init(&node->list);
-        free(node->value);
-        free(node);
+        release_value(node);
+        if (q->pool.single) {
+            free(node);
+        }
+    }
+    q->ops->destroy(q);
+
+    /* The cells go away with their chunks, or were freed one by one above.
+     * Elements removed but not yet released keep the pool alive until the
+     * last one comes back.
+     */
+    q->pool.live -= q->size;
+    if (q->pool.live == 0) {
+        pool_destroy(&q->pool);
+    } else {
+        q->pool.orphaned = true;
     }
-    free(l);
 }
 
-/* Insert an element at head of queue */
-bool q_insert_head(struct list_head *head, char *s)
+/* Release an element that is no longer linked into any queue */
+void q_release_element(element_t *e)
+{
+    release_value(e);
+    pool_free(e);
+}
+
+/* Allocate an element from the pool of queue @head holding a copy of @s */
+static element_t *q_new_element(struct list_head *head, char *s)
+{
+    element_t *e = pool_alloc(&to_queue(head)->pool, 0);
+    if (e == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(s) + 1;
+    if (fits_inline(e->pool, len)) {
+        e->value = e->inline_value;
+    } else {
+        e->value = value_alloc(len);
+        if (e->value == NULL) {
+            pool_free(e);
+            return NULL;
+        }
+    }
+    memcpy(e->value, s, len);
+    e->key = key_prefix(e->value);
+    return e;
+}
+
+/* Insert an element at head or tail of queue */
+static bool q_insert(struct list_head *head, char *s, bool at_tail)
 {
     if (head == NULL) {
         return false;
     }
-    element_t *new_node = malloc(sizeof(element_t));
-    if (new_node == NULL) {
+    queue_t *q = to_queue(head);
+    if (!q->ops->reserve(q, 1)) {
         return false;
     }
-    char *copy = malloc(strlen(s) + 1);
-    if (copy == NULL) {
-        free(new_node);
+    element_t *new_node = q_new_element(head, s);
+    if (new_node == NULL) {
         return false;
     }
-    strncpy(copy, s, strlen(s) + 1);
-    LIST_HEAD(new_list);
-    new_node->value = copy;
-    new_node->list = new_list;
-    list_add(&new_node->list, head);
+    q->ops->add(q, new_node, at_tail);
+    q->size++;
+    q_check_size(head);
     return true;
 }
 
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    return q_insert(head, s, false);
+}
+
 /* Insert an element at tail of queue */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    if (head == NULL) {
-        return false;
+    return q_insert(head, s, true);
+}
+
+/* Long strings of a bulk insert are carved from blocks of this size, so a
+ * string that outlives the others of its batch pins down little memory.
+ */
+#define STR_BLOCK_SIZE 4096
+
+/* Drop a reference to @block, freeing it with the last one */
+static inline void str_block_put(str_block_t *block)
+{
+    if (block && --block->refs == 0) {
+        free(block);
     }
-    element_t *new_node = malloc(sizeof(element_t));
-    if (new_node == NULL) {
+}
+
+/* Start a block with room for @bytes. The caller holds a reference of its
+ * own on it while carving strings.
+ */
+static str_block_t *str_block_new(size_t bytes)
+{
+    str_block_t *block = malloc(sizeof(str_block_t) + bytes);
+    if (block != NULL) {
+        block->refs = 1;
+    }
+    return block;
+}
+
+/* Give back the elements of a bulk insert that could not be completed */
+static void bulk_abort(struct list_head *batch, str_block_t *block)
+{
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, batch, list) {
+        release_value(e);
+        pool_free(e);
+    }
+    str_block_put(block);
+}
+
+/* Insert @n elements, the i-th holding a copy of sp[i % nstr], as if by
+ * calling q_insert_head() or q_insert_tail() for each in turn. Cells come
+ * from one pool chunk, long strings share blocks of STR_BLOCK_SIZE bytes
+ * unless the queue has no slab, and nothing is
+ * linked into the queue unless every allocation succeeded.
+ */
+static bool q_insert_bulk(struct list_head *head,
+                          char **sp,
+                          int nstr,
+                          int n,
+                          bool at_head)
+{
+    if (head == NULL || sp == NULL || nstr < 1 || n < 0) {
         return false;
     }
-    char *copy = malloc(strlen(s) + 1);
-    if (copy == NULL) {
-        free(new_node);
+    queue_t *q = to_queue(head);
+
+    if (!q->ops->reserve(q, n)) {
         return false;
     }
-    strncpy(copy, s, strlen(s) + 1);
-    LIST_HEAD(new_list);
-    new_node->value = copy;
-    new_node->list = new_list;
-    list_add_tail(&new_node->list, head);
+
+    str_block_t *block = NULL;
+    char *room = NULL, *room_end = NULL;
+    LIST_HEAD(batch);
+    for (int i = 0; i < n; i++) {
+        element_t *e = pool_alloc(&q->pool, n - i);
+        if (e == NULL) {
+            bulk_abort(&batch, block);
+            return false;
+        }
+        char *str = sp[i % nstr];
+        size_t len = strlen(str) + 1;
+        if (fits_inline(&q->pool, len)) {
+            e->value = e->inline_value;
+        } else if (q->pool.single) {
+            /* Without a slab, every string is allocated on its own */
+            e->value = value_alloc(len);
+            if (e->value == NULL) {
+                pool_free(e);
+                bulk_abort(&batch, block);
+                return false;
+            }
+        } else {
+            if ((size_t) (room_end - room) < str_block_room(len)) {
+                size_t bytes = STR_BLOCK_SIZE - sizeof(str_block_t);
+                if (bytes < str_block_room(len)) {
+                    bytes = str_block_room(len);
+                }
+                str_block_t *next = str_block_new(bytes);
+                if (next == NULL) {
+                    pool_free(e);
+                    bulk_abort(&batch, block);
+                    return false;
+                }
+                str_block_put(block);
+                block = next;
+                room = (char *) (block + 1);
+                room_end = room + bytes;
+            }
+            *(str_block_t **) room = block;
+            e->value = room + sizeof(str_block_t *);
+            room += str_block_room(len);
+            block->refs++;
+        }
+        memcpy(e->value, str, len);
+        e->key = key_prefix(e->value);
+        /* Build the batch in the order it ends up in the queue */
+        if (at_head) {
+            list_add(&e->list, &batch);
+        } else {
+            list_add_tail(&e->list, &batch);
+        }
+    }
+
+    str_block_put(block);
+    q->ops->splice(q, &batch, !at_head);
+    q->size += n;
+    q_check_size(head);
     return true;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+/* Insert @n elements at head of queue */
+bool q_insert_head_bulk(struct list_head *head, char **sp, int nstr, int n)
 {
-    if (head == NULL || list_empty(head)) {
-        return NULL;
+    return q_insert_bulk(head, sp, nstr, n, true);
+}
+
+/* Insert @n elements at tail of queue */
+bool q_insert_tail_bulk(struct list_head *head, char **sp, int nstr, int n)
+{
+    return q_insert_bulk(head, sp, nstr, n, false);
+}
+
+/* Smallest room given to a string once it is appended to */
+#define VALUE_MIN_ROOM 32
+
+/* Append @s to the value of @e.
+ * Strings allocated on their own double their room whenever they run out
+ * of it, so each appended byte is copied a constant number of times on
+ * average. An inline string that outgrows the element, or a string carved
+ * from a bulk block, first moves to storage of its own.
+ */
+static bool append_value(element_t *e, const char *s)
+{
+    size_t add = strlen(s);
+    bool alone =
+        e->value != e->inline_value && value_head(e->value)->owner == NULL;
+    size_t length = alone ? value_head(e->value)->length : strlen(e->value);
+
+    if (e->value == e->inline_value && length + add < ELEMENT_INLINE_SIZE) {
+        memcpy(e->value + length, s, add + 1);
+    } else {
+        if (!alone || value_head(e->value)->room <= length + add) {
+            size_t room = 2 * (length + add + 1);
+            if (room < VALUE_MIN_ROOM) {
+                room = VALUE_MIN_ROOM;
+            }
+            value_head_t *h;
+            if (alone) {
+                h = realloc(value_head(e->value), sizeof(*h) + room);
+                if (h == NULL) {
+                    return false;
+                }
+            } else {
+                h = malloc(sizeof(*h) + room);
+                if (h == NULL) {
+                    return false;
+                }
+                memcpy(h + 1, e->value, length);
+                release_value(e);
+                h->owner = NULL;
+            }
+            h->room = room;
+            e->value = (char *) (h + 1);
+        }
+        memcpy(e->value + length, s, add + 1);
+        value_head(e->value)->length = length + add;
     }
-    element_t *entry = list_first_entry(head, element_t, list);
-    if (sp != NULL) {
-        *sp = '\0';
-        strncat(sp, entry->value, bufsize - 1);
+    if (length < 8) {
+        e->key = key_prefix(e->value);
     }
-    list_del_init(&entry->list);
-    return entry;
+    return true;
 }
 
-/* Remove an element from tail of queue */
-element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+/* Append @s to the value of the element at head or tail of queue */
+static bool q_append(struct list_head *head, char *s, bool at_tail)
+{
+    if (head == NULL || s == NULL || q_size(head) == 0) {
+        return false;
+    }
+    queue_t *q = to_queue(head);
+    return append_value(q->ops->end(q, at_tail), s);
+}
+
+bool q_append_head(struct list_head *head, char *s)
+{
+    return q_append(head, s, false);
+}
+
+bool q_append_tail(struct list_head *head, char *s)
+{
+    return q_append(head, s, true);
+}
+
+/* Remove an element from head or tail of queue */
+static element_t *q_remove(struct list_head *head,
+                           char *sp,
+                           size_t bufsize,
+                           bool at_tail)
 {
-    if (head == NULL || list_empty(head)) {
+    if (head == NULL || q_size(head) == 0) {
         return NULL;
     }
-    element_t *entry = list_last_entry(head, element_t, list);
+    queue_t *q = to_queue(head);
+    element_t *entry = q->ops->remove(q, at_tail);
+    q->size--;
     if (sp != NULL) {
         *sp = '\0';
         strncat(sp, entry->value, bufsize - 1);
     }
-    list_del_init(&entry->list);
+    q_check_size(head);
     return entry;
 }
 
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    return q_remove(head, sp, bufsize, false);
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    return q_remove(head, sp, bufsize, true);
+}
+
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
 {
     if (head == NULL) {
         return 0;
     }
-    int count = 0;
-    struct list_head *node;
-    list_for_each (node, head) {
-        count++;
-    }
-    return count;
+    return to_queue(head)->size;
 }
 
 /* Delete the middle node in queue */
 bool q_delete_mid(struct list_head *head)
 {
-    if (list_empty(head)) {
+    if (head == NULL || q_size(head) == 0) {
         return false;
     }
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
-    struct list_head *fast = head->next, *slow = head->next;
-    while (fast != head && fast->next != head) {
-        fast = fast->next->next;
-        slow = slow->next;
-    }
-    list_del_init(slow);
-    element_t *entry = list_entry(slow, element_t, list);
-    free(entry->value);
-    free(entry);
+    queue_t *q = to_queue(head);
+    q_release_element(q->ops->remove_mid(q));
+    q->size--;
+    q_check_size(head);
     return true;
 }
 
@@ -150,30 +1039,139 @@ bool q_delete_mid(struct list_head *head)
 bool q_delete_dup(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
+    if (head == NULL) {
+        return false;
+    }
+    queue_t *q = to_queue(head);
+    q->ops->link(q);
+
     struct list_head *node = head->next, *tmp, *next_node;
     while (node != head) {
         next_node = node->next;
         element_t *curr = list_entry(node, element_t, list),
                   *next_ele = list_entry(next_node, element_t, list);
-        if (next_node != head && strcmp(curr->value, next_ele->value) == 0) {
-            while (next_node != head &&
-                   strcmp(curr->value, next_ele->value) == 0) {
+        if (next_node != head && cmp_element(curr, next_ele) == 0) {
+            while (next_node != head && cmp_element(curr, next_ele) == 0) {
                 tmp = next_node->next;
                 list_del_init(next_node);
 
-                free(next_ele->value);
-                free(next_ele);
+                q_release_element(next_ele);
+                q->size--;
                 next_node = tmp;
                 next_ele = list_entry(next_node, element_t, list);
             }
             list_del_init(node);
-            free(curr->value);
-            free(curr);
+            q_release_element(curr);
+            q->size--;
             node = next_node;
         } else {
             node = node->next;
         }
     }
+    q->ops->gather(q);
+    q_check_size(head);
+    return true;
+}
+
+/* Slot of the open-addressing table used by q_delete_dup_unsorted() */
+typedef struct {
+    element_t *e; /* first element seen holding the string */
+    uint32_t tag; /* upper half of the hash, to skip most string compares */
+    uint32_t count;
+} dup_slot_t;
+
+/* Hash the string of @e, reusing the cached prefix for its first 8 bytes */
+static uint64_t hash_element(const element_t *e)
+{
+    uint64_t h = e->key;
+    if (e->key & 0xff) {
+        for (const char *s = e->value + 8; *s; s++) {
+            h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+        }
+    }
+    /* Finalizer of MurmurHash3, so the low bits depend on every byte */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Find the slot holding the string of @e, or the empty slot it belongs in */
+static dup_slot_t *dup_lookup(dup_slot_t *table, size_t mask, element_t *e)
+{
+    uint64_t h = hash_element(e);
+    uint32_t tag = h >> 32;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        dup_slot_t *slot = &table[i];
+        if (!slot->e) {
+            slot->tag = tag;
+            return slot;
+        }
+        if (slot->tag == tag && cmp_element(slot->e, e) == 0) {
+            return slot;
+        }
+    }
+}
+
+static inline void dup_count(dup_slot_t *table, size_t mask, element_t *e)
+{
+    dup_slot_t *slot = dup_lookup(table, mask, e);
+    if (!slot->e) {
+        slot->e = e;
+    }
+    slot->count++;
+}
+
+/* Delete all nodes that have duplicate string, in any order */
+bool q_delete_dup_unsorted(struct list_head *head)
+{
+    if (head == NULL) {
+        return false;
+    }
+    queue_t *q = to_queue(head);
+    size_t mask = 1;
+    while (mask < 2 * (size_t) q->size) {
+        mask <<= 1;
+    }
+    dup_slot_t *table = malloc(mask * sizeof(dup_slot_t));
+    if (table == NULL) {
+        return false;
+    }
+    memset(table, 0, mask * sizeof(dup_slot_t));
+    mask--;
+
+    /* First pass: count every string */
+    q->ops->link(q);
+    element_t *e, *safe;
+    list_for_each_entry (e, head, list) {
+        dup_count(table, mask, e);
+    }
+
+    /* Second pass: drop every element whose string is not unique. The
+     * element a slot refers to is needed for comparisons until the end, so
+     * it is only released in the last pass over the table.
+     */
+    list_for_each_entry_safe (e, safe, head, list) {
+        dup_slot_t *slot = dup_lookup(table, mask, e);
+        if (slot->count == 1) {
+            continue;
+        }
+        list_del_init(&e->list);
+        q->size--;
+        if (slot->e != e) {
+            q_release_element(e);
+        }
+    }
+    for (size_t i = 0; i <= mask; i++) {
+        if (table[i].count > 1) {
+            q_release_element(table[i].e);
+        }
+    }
+    free(table);
+    q->ops->gather(q);
+    q_check_size(head);
     return true;
 }
 
@@ -181,9 +1179,11 @@ bool q_delete_dup(struct list_head *head)
 void q_swap(struct list_head *head)
 {
     // https://leetcode.com/problems/swap-nodes-in-pairs/
-    if (list_empty(head) || list_is_singular(head)) {
+    if (q_size(head) < 2) {
         return;
     }
+    queue_t *q = to_queue(head);
+    q->ops->link(q);
     struct list_head *first, *second;
     first = head->next;
     second = first->next;
@@ -192,7 +1192,7 @@ void q_swap(struct list_head *head)
         first = first->next;
         second = first->next;
     }
-    return;
+    q->ops->gather(q);
 }
 
 /* Reverse elements in queue */
@@ -201,60 +1201,482 @@ void q_reverse(struct list_head *head)
     if (head == NULL) {
         return;
     }
+    queue_t *q = to_queue(head);
+    q->ops->link(q);
     struct list_head *node, *safe;
     list_for_each_safe (node, safe, head) {
         list_move(node, head);
     }
+    q->ops->gather(q);
 }
 
 
-struct list_head *merge(struct list_head *l, struct list_head *r)
+/* Compare the strings held by two list nodes */
+static inline int cmp_node(const struct list_head *a, const struct list_head *b)
+{
+    return cmp_element(list_entry(a, element_t, list),
+                       list_entry(b, element_t, list));
+}
+
+/* Merge two NULL-terminated, singly-linked sorted lists.
+ * On equal keys the node from @a goes first, which keeps the sort stable.
+ * The prev pointers are left untouched.
+ */
+struct list_head *merge(struct list_head *a, struct list_head *b)
 {
     struct list_head *head = NULL;
-    struct list_head **ptr = &head;
-    for (; l && r; ptr = &(*ptr)->next) {
-        element_t *ele_l = list_entry(l, element_t, list);
-        element_t *ele_r = list_entry(r, element_t, list);
-        if (strcmp(ele_l->value, ele_r->value) <= 0) {
-            *ptr = l;
-            l = l->next;
+    struct list_head **tail = &head;
+    for (;;) {
+        if (cmp_node(a, b) <= 0) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
         } else {
-            *ptr = r;
-            r = r->next;
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
         }
     }
+    return head;
+}
 
-    if (l)
-        *ptr = l;
-    if (r)
-        *ptr = r;
+/* Like merge(), but splice the result back into the circular list at @head
+ * and rebuild the prev pointers along the way, so no separate walk is needed.
+ * Either @a or @b may be NULL.
+ */
+static void merge_final(struct list_head *head,
+                        struct list_head *a,
+                        struct list_head *b)
+{
+    struct list_head *tail = head;
+    while (a && b) {
+        if (cmp_node(a, b) <= 0) {
+            tail->next = a;
+            a->prev = tail;
+            tail = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b->prev = tail;
+            tail = b;
+            b = b->next;
+        }
+    }
 
-    return head;
+    /* Finish linking the remainder, which is already in order */
+    for (b = a ? a : b; b; b = b->next) {
+        tail->next = b;
+        b->prev = tail;
+        tail = b;
+    }
+    tail->next = head;
+    head->prev = tail;
+}
+
+/* Detach the natural run starting at @list and return it as a
+ * NULL-terminated list. A descending run is reversed in place, except that
+ * nodes with equal keys keep their input order, which keeps the sort stable.
+ * The first node after the run is stored in *rest.
+ */
+static struct list_head *take_run(struct list_head *list,
+                                  struct list_head **rest)
+{
+    struct list_head *next = list->next;
+    if (!next || cmp_node(list, next) <= 0) {
+        struct list_head *tail = list;
+        while (tail->next && cmp_node(tail, tail->next) <= 0)
+            tail = tail->next;
+        *rest = tail->next;
+        tail->next = NULL;
+        return list;
+    }
+
+    /* Push each smaller node to the front, but link an equal node behind
+     * the last one of the group currently at the front.
+     */
+    struct list_head *run = list, *group = list;
+    run->next = NULL;
+    while (next) {
+        int diff = cmp_node(run, next);
+        if (diff < 0)
+            break;
+        struct list_head *tmp = next->next;
+        if (diff > 0) {
+            next->next = run;
+            run = next;
+        } else {
+            next->next = group->next;
+            group->next = next;
+        }
+        group = next;
+        next = tmp;
+    }
+    *rest = next;
+    return run;
+}
+
+/*
+ * Sort the list hanging off @head, which holds at least two elements.
+ *
+ * This is a bottom-up merge sort modeled after list_sort() in the Linux
+ * kernel. Instead of single nodes, the input is consumed one natural run at
+ * a time, so already sorted or reversed queues are handled in O(n).
+ * Sorted runs wait in a "pending" stack linked through their prev pointers;
+ * whenever the number of runs reaches 2^k + 2^(k-1), the two runs of the
+ * lowest filled size class are merged, which keeps merges balanced at
+ * 2:1 or better without any recursion.
+ */
+static void sort_list(struct list_head *head)
+{
+    struct list_head *list = head->next, *pending = NULL;
+    size_t count = 0;
+    head->prev->next = NULL;
+
+    do {
+        size_t bits;
+        struct list_head **tail = &pending;
+
+        /* Find the least-significant clear bit in count */
+        for (bits = count; bits & 1; bits >>= 1)
+            tail = &(*tail)->prev;
+        /* Do the indicated merge, unless count is 2^k - 1 */
+        if (bits) {
+            struct list_head *a = *tail, *b = a->prev;
+            a = merge(b, a);
+            a->prev = b->prev;
+            *tail = a;
+        }
+
+        /* Move one run from the input to the pending stack */
+        struct list_head *run = take_run(list, &list);
+        run->prev = pending;
+        pending = run;
+        count++;
+    } while (list);
+
+    /* Merge all the pending runs together, from smallest to largest */
+    list = pending;
+    pending = pending->prev;
+    if (!pending) {
+        merge_final(head, list, NULL);
+        return;
+    }
+    for (;;) {
+        struct list_head *next = pending->prev;
+        if (!next)
+            break;
+        list = merge(pending, list);
+        pending = next;
+    }
+    merge_final(head, pending, list);
+}
+
+static q_sort_algo_t sort_algo = Q_SORT_MERGE;
+
+/* Buckets holding fewer elements than this are handed to sort_list() */
+#define RADIX_CUTOFF 32
+
+/* Byte @depth of the string of @e, which is at least @depth bytes long */
+static inline unsigned int radix_byte(const element_t *e, int depth)
+{
+    if (depth < 8) {
+        return (e->key >> (56 - 8 * depth)) & 0xff;
+    }
+    return (unsigned char) e->value[depth];
+}
+
+/*
+ * Sort the @n elements hanging off @head, whose strings share their first
+ * @depth bytes, with an MSD radix sort.
+ *
+ * Each pass distributes the nodes into one bucket per byte value, which
+ * keeps their relative order, so the sort is stable. Bucket 0 holds strings
+ * that have ended and needs no further work, small buckets are finished by
+ * sort_list(), and the other buckets are sorted recursively before being
+ * spliced back in order. The largest bucket is sorted by the next pass of
+ * the loop instead, which bounds the recursion depth by log2(n); the nodes
+ * around it are spliced back first and @hole marks where it belongs.
+ */
+static void radix_sort(struct list_head *head, int n, int depth)
+{
+    LIST_HEAD(cur);
+    struct list_head *hole = head;
+    list_splice_init(head, &cur);
+
+    while (n >= RADIX_CUTOFF) {
+        struct list_head buckets[256];
+        int count[256] = {0};
+        for (int c = 0; c < 256; c++) {
+            INIT_LIST_HEAD(&buckets[c]);
+        }
+
+        struct list_head *node, *safe;
+        list_for_each_safe (node, safe, &cur) {
+            unsigned int c = radix_byte(list_entry(node, element_t, list),
+                                        depth);
+            list_add_tail(node, &buckets[c]);
+            count[c]++;
+        }
+        INIT_LIST_HEAD(&cur);
+
+        int largest = 0;
+        for (int c = 1; c < 256; c++) {
+            if (count[c] && (!largest || count[c] > count[largest])) {
+                largest = c;
+            }
+        }
+        if (!largest) {
+            /* Every string has ended, so they are all equal */
+            list_splice(&buckets[0], hole);
+            return;
+        }
+
+        /* Splice the buckets above the largest one after @hole, then the
+         * ones below it in front of them, leaving the hole in between.
+         */
+        for (int c = 255; c > largest; c--) {
+            if (count[c] > 1) {
+                radix_sort(&buckets[c], count[c], depth + 1);
+            }
+            list_splice(&buckets[c], hole);
+        }
+        struct list_head *above = hole->next;
+        for (int c = largest - 1; c >= 0; c--) {
+            if (c && count[c] > 1) {
+                radix_sort(&buckets[c], count[c], depth + 1);
+            }
+            list_splice(&buckets[c], hole);
+        }
+        hole = above->prev;
+        list_splice(&buckets[largest], &cur);
+        n = count[largest];
+        depth++;
+    }
+
+    if (n > 1) {
+        sort_list(&cur);
+    }
+    list_splice(&cur, hole);
 }
 
-struct list_head *merge_sort_list(struct list_head *head)
+/* Sort the @n elements hanging off @head with the selected algorithm */
+static void sort_any(struct list_head *head, int n)
 {
-    if (!head || !head->next)
-        return head;
+    if (sort_algo == Q_SORT_RADIX && n >= RADIX_CUTOFF) {
+        radix_sort(head, n, 0);
+    } else {
+        sort_list(head);
+    }
+}
 
-    struct list_head *fast, *slow;
-    slow = head;
-    fast = slow->next;
+/* Sort queues of at least sort_threshold elements on sort_threads threads */
+static int sort_threads = 1;
+static int sort_threshold = SORT_THRESHOLD;
 
-    for (; fast && fast->next; fast = fast->next->next) {
-        slow = slow->next;
+/* Unit of work handed to the sort thread pool */
+typedef struct {
+    struct list_head head; /* sentinel of the slice while it is sorted */
+    struct list_head *list, *other; /* NULL-terminated runs to merge */
+    int size;
+} sort_task_t;
+
+/* Thread pool used by parallel sorts.
+ * Workers are started on demand and kept for the lifetime of the process.
+ * A batch of tasks is published under @lock; the submitting thread works on
+ * the batch too and returns once @pending drops to zero. Threads sorting
+ * at the same time take turns through @busy.
+ */
+static struct {
+    pthread_mutex_t busy, lock;
+    pthread_cond_t work, done;
+    int nworkers;
+    void (*fn)(sort_task_t *task);
+    sort_task_t *tasks;
+    int ntasks, next, pending;
+} sort_pool = {
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Run tasks of the current batch until none is left to start.
+ * Called and returns with sort_pool.lock held.
+ */
+static void sort_pool_drain(void)
+{
+    while (sort_pool.next < sort_pool.ntasks) {
+        sort_task_t *task = &sort_pool.tasks[sort_pool.next++];
+        pthread_mutex_unlock(&sort_pool.lock);
+        sort_pool.fn(task);
+        pthread_mutex_lock(&sort_pool.lock);
+        if (--sort_pool.pending == 0) {
+            pthread_cond_signal(&sort_pool.done);
+        }
     }
+}
 
-    struct list_head *mid = slow->next;
-    slow->next = NULL;
+static void *sort_worker(void *arg)
+{
+    pthread_mutex_lock(&sort_pool.lock);
+    for (;;) {
+        while (sort_pool.next >= sort_pool.ntasks) {
+            pthread_cond_wait(&sort_pool.work, &sort_pool.lock);
+        }
+        sort_pool_drain();
+    }
+    return NULL;
+}
 
-    struct list_head *l = merge_sort_list(head), *r = merge_sort_list(mid);
-    return merge(l, r);
+/* Make sure @n workers are running. They start with every signal blocked
+ * but the ones raised by a fault, so timeouts are handled on the thread that
+ * called q_sort() and a fault in a worker still reaches the handler. Return
+ * the number of workers available.
+ */
+static int sort_pool_start(int n)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    sigdelset(&all, SIGBUS);
+    sigdelset(&all, SIGFPE);
+    sigdelset(&all, SIGILL);
+    pthread_mutex_lock(&sort_pool.busy);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    while (sort_pool.nworkers < n) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, sort_worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(tid);
+        sort_pool.nworkers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    int nworkers = sort_pool.nworkers;
+    pthread_mutex_unlock(&sort_pool.busy);
+    return nworkers;
+}
+
+/* Apply @fn to each of the @n tasks in parallel and wait for all of them */
+static void sort_pool_run(void (*fn)(sort_task_t *task),
+                          sort_task_t *tasks,
+                          int n)
+{
+    pthread_mutex_lock(&sort_pool.busy);
+    pthread_mutex_lock(&sort_pool.lock);
+    sort_pool.fn = fn;
+    sort_pool.tasks = tasks;
+    sort_pool.ntasks = n;
+    sort_pool.next = 0;
+    sort_pool.pending = n;
+    pthread_cond_broadcast(&sort_pool.work);
+    sort_pool_drain();
+    while (sort_pool.pending) {
+        pthread_cond_wait(&sort_pool.done, &sort_pool.lock);
+    }
+    sort_pool.ntasks = 0;
+    pthread_mutex_unlock(&sort_pool.lock);
+    pthread_mutex_unlock(&sort_pool.busy);
 }
 
-void merge_sort(struct list_head **list)
+/* Sort one slice, leaving it NULL-terminated in task->list */
+static void sort_slice(sort_task_t *task)
 {
-    *list = merge_sort_list(*list);
+    sort_any(&task->head, task->size);
+    task->list = task->head.next;
+    task->head.prev->next = NULL;
+}
+
+/* Merge the sorted lists of two neighbouring slices */
+static void merge_slices(sort_task_t *task)
+{
+    task->list = merge(task->list, task->other);
+}
+
+/*
+ * Sort the list hanging off @head, which holds @n elements, with up to
+ * sort_threads threads.
+ *
+ * The list is cut into one contiguous slice per thread. Slices are sorted
+ * concurrently and then merged pairwise in a tree, always keeping the
+ * earlier slice on the left, so equal elements keep their input order and
+ * the result is identical to that of sort_list().
+ *
+ * SIGALRM stays blocked until the list is whole again. A handler that jumps
+ * out of the sort would otherwise leave the pool locked and the workers
+ * rearranging a list the caller goes on to use; the timeout is delivered
+ * once the sort is done instead.
+ */
+static void sort_list_parallel(struct list_head *head, int n)
+{
+    sigset_t alrm, old;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &old);
+
+    int nslices = sort_pool_start(sort_threads - 1) + 1;
+    if (nslices > sort_threads) {
+        nslices = sort_threads;
+    }
+    sort_task_t slices[SORT_MAX_THREADS];
+    struct list_head *node = head->next;
+    for (int i = 0; i < nslices; i++) {
+        int len = n / nslices + (i < n % nslices);
+        struct list_head *sentinel = &slices[i].head;
+        slices[i].size = len;
+        sentinel->next = node;
+        node->prev = sentinel;
+        while (--len) {
+            node = node->next;
+        }
+        sentinel->prev = node;
+        node = node->next;
+        sentinel->prev->next = sentinel;
+    }
+    sort_pool_run(sort_slice, slices, nslices);
+
+    /* Merge neighbouring slices pairwise until two are left, which are
+     * merged back into @head.
+     */
+    for (int m = nslices; m > 2; m = (m + 1) / 2) {
+        for (int i = 0; i < m / 2; i++) {
+            struct list_head *a = slices[2 * i].list;
+            slices[i].other = slices[2 * i + 1].list;
+            slices[i].list = a;
+        }
+        if (m & 1) {
+            slices[m / 2].list = slices[m - 1].list;
+        }
+        sort_pool_run(merge_slices, slices, m / 2);
+    }
+    merge_final(head, slices[0].list, nslices > 1 ? slices[1].list : NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Select how many threads sort large queues */
+void q_set_sort_threads(int threads, int threshold)
+{
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > SORT_MAX_THREADS) {
+        threads = SORT_MAX_THREADS;
+    }
+    sort_threads = threads;
+    sort_threshold = threshold;
+}
+
+/* Select the algorithm used by q_sort() */
+void q_set_sort_algo(q_sort_algo_t a)
+{
+    sort_algo = a;
 }
 
 /*
@@ -264,24 +1686,25 @@ void merge_sort(struct list_head **list)
  */
 void q_sort(struct list_head *head)
 {
-    if (head == NULL || list_empty(head) || list_is_singular(head))
+    if (q_size(head) < 2)
         return;
 
-    struct list_head *list = head->next;
-    head->prev->next = NULL;
+    /* Sort through the list links, which needs no extra memory */
+    queue_t *q = to_queue(head);
+    q->ops->link(q);
+    if (sort_threads > 1 && q->size >= sort_threshold &&
+        q->size >= 2 * sort_threads) {
+        sort_list_parallel(head, q->size);
+    } else {
+        sort_any(head, q->size);
+    }
+    q->ops->gather(q);
+}
 
-    merge_sort(&list);
-
-    // recovery
-    struct list_head *curr = list->next;
-    struct list_head *last = list;
-    last->prev = head;
-    head->next = last;
-    while (curr) {
-        curr->prev = last;
-        curr = curr->next;
-        last = last->next;
-    }
-    last->next = head;
-    head->prev = last;
-}
\ No newline at end of file
+/* Bring the list links of queue up to date */
+void q_sync(struct list_head *head)
+{
+    if (head) {
+        to_queue(head)->ops->link(to_queue(head));
+    }
+}
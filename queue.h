@@ -9,23 +9,104 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "harness.h"
 #include "list.h"
 
+struct q_pool;
+
+/* Strings shorter than this are stored inside the element itself */
+#define ELEMENT_INLINE_SIZE 16
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @key: first 8 bytes of the string, big-endian and zero padded
+ * @pool: cell pool of the queue the element was allocated from
+ * @inline_value: storage for strings shorter than ELEMENT_INLINE_SIZE
  *
- * @value needs to be explicitly allocated and freed
+ * @value either points to @inline_value or to a separately allocated copy,
+ * which needs to be explicitly freed. The element itself is carved from a
+ * per-queue pool and must be given back through q_release_element().
+ * Queues created after q_set_pool(false) allocate every element and every
+ * string on its own instead.
+ *
+ * Comparing @key as an integer orders two strings the same way strcmp()
+ * does, as long as their first 8 bytes differ.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t key;
+    struct q_pool *pool;
+    char inline_value[ELEMENT_INLINE_SIZE];
 } element_t;
 
+/**
+ * q_engine_t - Data structure backing a queue
+ * @Q_ENGINE_LIST: circular doubly-linked list of elements
+ * @Q_ENGINE_RING: growable ring buffer of element pointers
+ *
+ * Both engines hand out the same struct list_head handle, whose next and
+ * prev pointers always lead to the first and last element. A queue backed by
+ * the ring engine only brings the links between its elements up to date in
+ * q_sync().
+ */
+typedef enum { Q_ENGINE_LIST, Q_ENGINE_RING } q_engine_t;
+
 /* Operations on queue */
 
+/**
+ * q_set_engine() - Select the engine of queues created by later q_new() calls
+ * @e: engine to use, Q_ENGINE_LIST by default
+ */
+void q_set_engine(q_engine_t e);
+
+/**
+ * q_set_pool() - Select how queues created by later q_new() calls allocate
+ * @on: carve elements from a per-queue slab and store short strings inline,
+ *      true by default
+ *
+ * With @on false, each element and each string is a separate malloc() call,
+ * so that the allocation harness sees every one of them: a double
+ * q_release_element() is reported, and injected malloc failures hit every
+ * insert instead of only the ones that grow the slab.
+ */
+void q_set_pool(bool on);
+
+/**
+ * q_sort_algo_t - Algorithm used by q_sort()
+ * @Q_SORT_MERGE: natural bottom-up merge sort
+ * @Q_SORT_RADIX: MSD radix sort over the bytes of the strings, which falls
+ *                back to merge sort for small buckets
+ *
+ * Both are stable and produce the same order.
+ */
+typedef enum { Q_SORT_MERGE, Q_SORT_RADIX } q_sort_algo_t;
+
+/**
+ * q_set_sort_algo() - Select the algorithm used by later q_sort() calls
+ * @a: algorithm to use, Q_SORT_MERGE by default
+ */
+void q_set_sort_algo(q_sort_algo_t a);
+
+/* Upper bound on the number of threads q_sort() may use */
+#define SORT_MAX_THREADS 64
+/* Default size from which a queue is sorted in parallel */
+#define SORT_THRESHOLD (1 << 17)
+
+/**
+ * q_set_sort_threads() - Let q_sort() split large queues across threads
+ * @threads: number of threads to use, 1 (the default) sorts serially
+ * @threshold: minimum number of elements a queue needs to be sorted in
+ *             parallel
+ *
+ * The result is the same as that of a serial sort, including the order of
+ * equal elements. @threads is clamped to [1, SORT_MAX_THREADS].
+ */
+void q_set_sort_threads(int threads, int threshold);
+
 /**
  * q_new() - Create an empty queue whose next and prev pointer point to itself
  *
@@ -63,6 +144,62 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_bulk() - Insert a batch of elements at the head
+ * @head: header of queue
+ * @sp: array of strings to be inserted
+ * @nstr: number of strings in @sp
+ * @n: number of elements to insert
+ *
+ * The i-th element inserted holds a copy of sp[i % nstr], so @nstr == @n
+ * inserts every string once and @nstr == 1 repeats a single string. The
+ * queue ends up as if q_insert_head() had been called for each element in
+ * turn, but all storage is allocated in batches and either every element
+ * is inserted or none is.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_bulk(struct list_head *head, char **sp, int nstr, int n);
+
+/**
+ * q_insert_tail_bulk() - Insert a batch of elements at the tail
+ * @head: header of queue
+ * @sp: array of strings to be inserted
+ * @nstr: number of strings in @sp
+ * @n: number of elements to insert
+ *
+ * Like q_insert_head_bulk(), but as if q_insert_tail() had been called for
+ * each element in turn.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_bulk(struct list_head *head, char **sp, int nstr, int n);
+
+/**
+ * q_append_head() - Append a string to the value of the head element
+ * @head: header of queue
+ * @s: string to be appended
+ *
+ * The value grows in place when it can, so that a run of appends to the
+ * same element takes amortised constant time per byte appended.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL or
+ * empty
+ */
+bool q_append_head(struct list_head *head, char *s);
+
+/**
+ * q_append_tail() - Append a string to the value of the tail element
+ * @head: header of queue
+ * @s: string to be appended
+ *
+ * Like q_append_head(), but for the element at the tail.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL or
+ * empty
+ */
+bool q_append_tail(struct list_head *head, char *s);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -97,13 +234,10 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  * q_release_element() - Release the element
  * @e: element would be released
  *
+ * Free the string and return the element to the pool it was allocated from.
  * This function is intended for internal use only.
  */
-static inline void q_release_element(element_t *e)
-{
-    test_free(e->value);
-    test_free(e);
-}
+void q_release_element(element_t *e);
 
 /**
  * q_size() - Get the size of the queue
@@ -124,6 +258,8 @@ int q_size(struct list_head *head);
  * Reference:
  * https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
  *
+ * Takes O(1) time on queues backed by the ring engine.
+ *
  * Return: true for success, false if list is NULL or empty.
  */
 bool q_delete_mid(struct list_head *head);
@@ -140,6 +276,19 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/**
+ * q_delete_dup_unsorted() - Delete all nodes that have duplicate string,
+ *                           without requiring the queue to be sorted.
+ * @head: header of queue
+ *
+ * Like q_delete_dup(), every copy of a string that occurs more than once is
+ * deleted, but copies need not be adjacent. Strings are counted in a hash
+ * table first, so this runs in expected O(n) time.
+ *
+ * Return: true for success, false if list is NULL or allocation failed.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
 /**
  * q_delete_dup() - Swap every two adjacent nodes
  * @head: header of queue
@@ -169,4 +318,16 @@ void q_reverse(struct list_head *head);
  */
 void q_sort(struct list_head *head);
 
+/**
+ * q_sync() - Bring the list links of queue up to date
+ * @head: header of queue
+ *
+ * Must be called before walking a queue through its list links. Looking at
+ * the first or last element through head->next or head->prev needs no
+ * call. Queues backed by the ring engine keep their order in arrays and only
+ * relink the elements that moved since the previous call. No effect on
+ * queues backed by the list engine.
+ */
+void q_sync(struct list_head *head);
+
 #endif /* LAB0_QUEUE_H */
@@ -2,10 +2,17 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Bytes read from /dev/urandom at once and handed out by randombytes() */
+#define RANDOM_BUFFER_SIZE 4096
 
 /* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+static void urandom_read(uint8_t *x, size_t how_much)
 {
     ssize_t i;
     static int fd = -1;
@@ -37,3 +44,178 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+/* Serve small requests, such as those of randombit(), from a buffer so that
+ * they do not each cost a system call
+ */
+void randombytes(uint8_t *x, size_t how_much)
+{
+    static uint8_t buffer[RANDOM_BUFFER_SIZE];
+    static size_t avail = 0;
+
+    if (how_much >= RANDOM_BUFFER_SIZE) {
+        urandom_read(x, how_much);
+        return;
+    }
+
+    while (how_much) {
+        if (!avail) {
+            urandom_read(buffer, sizeof(buffer));
+            avail = sizeof(buffer);
+        }
+        size_t n = how_much < avail ? how_much : avail;
+        memcpy(x, buffer + sizeof(buffer) - avail, n);
+        avail -= n;
+        x += n;
+        how_much -= n;
+    }
+}
+
+static uint64_t prng_state[4] = {1, 2, 3, 4};
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64, which spreads any seed, even 0, over the whole state */
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void prng_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+        prng_state[i] = splitmix64(&seed);
+}
+
+/* xoshiro256** by David Blackman and Sebastiano Vigna */
+uint64_t prng_next(void)
+{
+    uint64_t *s = prng_state;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/* Letters come from the 16-bit chunks of random words, so each word makes
+ * four of them. A chunk x maps to 'a' + (x * 26 >> 16), which every kernel
+ * below computes exactly, so a seed gives the same strings on any CPU.
+ */
+#define LETTER_BATCH 64 /* words drawn at once, a multiple of 4 */
+
+static void letters_scalar(char *dst, const uint64_t *words, size_t nwords)
+{
+    for (size_t i = 0; i < nwords; i++) {
+        uint64_t w = words[i];
+        for (int k = 0; k < 4; k++, w >>= 16)
+            *dst++ = 'a' + (char) (((w & 0xffff) * 26) >> 16);
+    }
+}
+
+#ifdef __SSE2__
+/* Eight chunks per vector, scaled with one high-half multiply */
+static void letters_sse2(char *dst, const uint64_t *words, size_t nwords)
+{
+    const __m128i range = _mm_set1_epi16(26), base = _mm_set1_epi16('a');
+    for (size_t i = 0; i < nwords; i += 4) {
+        __m128i lo = _mm_loadu_si128((const __m128i *) (words + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *) (words + i + 2));
+        lo = _mm_add_epi16(_mm_mulhi_epu16(lo, range), base);
+        hi = _mm_add_epi16(_mm_mulhi_epu16(hi, range), base);
+        _mm_storeu_si128((__m128i *) (dst + 4 * i), _mm_packus_epi16(lo, hi));
+    }
+}
+#endif
+
+#ifdef __x86_64__
+/* Sixteen chunks per vector. Packing works within 128-bit lanes, so the
+ * middle quarters are swapped back into place afterwards.
+ */
+__attribute__((target("avx2"))) static void letters_avx2(char *dst,
+                                                         const uint64_t *words,
+                                                         size_t nwords)
+{
+    const __m256i range = _mm256_set1_epi16(26), base = _mm256_set1_epi16('a');
+    for (size_t i = 0; i < nwords; i += 8) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *) (words + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *) (words + i + 4));
+        lo = _mm256_add_epi16(_mm256_mulhi_epu16(lo, range), base);
+        hi = _mm256_add_epi16(_mm256_mulhi_epu16(hi, range), base);
+        __m256i packed = _mm256_packus_epi16(lo, hi);
+        _mm256_storeu_si256((__m256i *) (dst + 4 * i),
+                            _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+}
+#endif
+
+typedef void (*letters_fn)(char *dst, const uint64_t *words, size_t nwords);
+
+/* Widest kernel the CPU runs. Batches are multiples of 4 words for SSE2,
+ * and of 8 words once AVX2 is picked.
+ */
+static letters_fn letters_kernel(size_t nwords)
+{
+#ifdef __x86_64__
+    static int avx2 = -1;
+    if (avx2 < 0)
+        avx2 = __builtin_cpu_supports("avx2");
+    if (avx2 && nwords % 8 == 0)
+        return letters_avx2;
+#endif
+#ifdef __SSE2__
+    if (nwords % 4 == 0)
+        return letters_sse2;
+#endif
+    return letters_scalar;
+}
+
+void prng_letters(char *dst, size_t n)
+{
+    uint64_t words[LETTER_BATCH];
+    char tail[4 * LETTER_BATCH];
+    while (n) {
+        size_t len = n < sizeof(tail) ? n : sizeof(tail);
+        size_t nwords = ((len + 3) / 4 + 7) & ~(size_t) 7;
+        for (size_t i = 0; i < nwords; i++)
+            words[i] = prng_next();
+        if (len == sizeof(tail)) {
+            letters_kernel(nwords)(dst, words, nwords);
+        } else {
+            letters_kernel(nwords)(tail, words, nwords);
+            memcpy(dst, tail, len);
+        }
+        dst += len;
+        n -= len;
+    }
+}
+
+void prng_strings(char *buf,
+                  size_t n,
+                  size_t stride,
+                  size_t min_len,
+                  size_t max_len)
+{
+    assert(min_len <= max_len && max_len < stride);
+    prng_letters(buf, n * stride);
+
+    uint64_t w = 0;
+    for (size_t i = 0; i < n; i++, w >>= 16) {
+        if (i % 4 == 0)
+            w = prng_next();
+        size_t len = min_len + (((w & 0xffff) * (max_len - min_len + 1)) >> 16);
+        buf[i * stride + len] = '\0';
+    }
+}
@@ -13,4 +13,26 @@ static inline uint8_t randombit(void)
     return ret & 1;
 }
 
+/* Seed the generator behind prng_next() */
+void prng_seed(uint64_t seed);
+
+/* Return 64 random bits from xoshiro256**, which is fast and can be
+ * replayed from its seed, but is not fit for cryptographic use
+ */
+uint64_t prng_next(void);
+
+/* Fill @dst with @n random lowercase letters, from prng_next() */
+void prng_letters(char *dst, size_t n);
+
+/*
+ * Write @n random strings of lowercase letters into @buf, one every
+ * @stride bytes. Their lengths are spread evenly from @min_len to @max_len,
+ * which must be less than @stride.
+ */
+void prng_strings(char *buf,
+                  size_t n,
+                  size_t stride,
+                  size_t min_len,
+                  size_t max_len);
+
 #endif
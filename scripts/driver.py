@@ -17,6 +17,7 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    engine = ""
 
     traceDict = {
         1: "trace-01-ops",
@@ -35,7 +36,21 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-counter",
+        19: "trace-19-dedup",
+        20: "trace-20-threads",
+        21: "trace-21-radix",
+        22: "trace-22-bulk",
+        23: "trace-23-arena",
+        24: "trace-24-sample",
+        25: "trace-25-guard",
+        26: "trace-26-allocstats",
+        27: "trace-27-stress",
+        28: "trace-28-append",
+        29: "trace-29-fault",
+        30: "trace-30-seed",
+        31: "trace-31-complexity"
     }
 
     traceProbs = {
@@ -55,10 +70,25 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28",
+        29: "Trace-29",
+        30: "Trace-30",
+        31: "Trace-31"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5,
+                 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,13 +99,15 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 engine=""):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.engine = engine
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -89,6 +121,8 @@ class Tracer:
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.engine != "":
+            clist += ["-e", self.engine]
 
         try:
             retcode = subprocess.call(clist)
@@ -146,11 +180,12 @@ class Tracer:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [-e ENGINE] [--valgrind] [-c]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
+    print("  -e ENGINE Queue engine to test (list or ring)")
     print("  -c Enable colored text")
     sys.exit(0)
 
@@ -163,8 +198,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    engine = ""
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:ce:', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +217,8 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-e':
+            engine = val
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +228,8 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               engine=engine)
     t.run(tid)
 
 
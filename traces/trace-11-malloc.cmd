@@ -1,4 +1,5 @@
 # Test of malloc failure on insert_head
+option pool 0
 option fail 30
 option malloc 0
 new
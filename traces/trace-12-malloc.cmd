@@ -1,4 +1,5 @@
 # Test of malloc failure on insert_tail
+option pool 0
 option fail 50
 option malloc 0
 new
@@ -0,0 +1,7 @@
+# Test constant time by perf cycle counts, or by time stamps without them
+option counter 2
+option simulation 1
+ih
+rt
+option simulation 0
+option counter 1
@@ -0,0 +1,24 @@
+# Test of dedup -u on unsorted queues
+option fail 10
+option malloc 0
+new
+ih gerbil
+ih bear
+ih gerbil
+it dolphin
+it bear
+ih meerkat
+fault nth 1 in dedup
+dedup -u
+fault off
+dedup -u
+rh meerkat
+rh dolphin
+ih RAND 1000
+it RAND 1000
+it bear 3
+dedup -u
+free
+new
+dedup -u
+free
@@ -0,0 +1,16 @@
+# Test of sorting on several threads
+option fail 0
+option malloc 0
+option threads 4
+option threshold 1000
+new
+ih RAND 20000
+it gerbil 3000
+ih dolphin 3000
+sort
+reverse
+sort
+dedup
+free
+option threads 1
+option threshold 131072
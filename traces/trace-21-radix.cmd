@@ -0,0 +1,23 @@
+# Test of radix sort, alone and on several threads
+option fail 0
+option malloc 0
+option radix 1
+new
+ih RAND 20000
+it aardvark_bear_dolphin_gerbil_jaguar 500
+it aardvark_bear_dolphin_gerbil 500
+it a 500
+sort
+rh a
+reverse
+sort
+free
+new
+option threads 4
+option threshold 1000
+ih RAND 20000
+sort
+free
+option threads 1
+option threshold 131072
+option radix 0
@@ -0,0 +1,15 @@
+# Test of bulk inserts and their malloc failures
+option pool 0
+option fail 30
+option malloc 0
+new
+ih dolphin 1000
+it gerbil 1000
+ih RAND 3000
+rt gerbil
+option malloc 25
+it aardvark_bear_dolphin_gerbil_jaguar 15
+ih RAND 15
+option malloc 0
+free
+option pool 1
@@ -0,0 +1,17 @@
+# Test of the allocation arena and its reset
+option fail 0
+option malloc 0
+option arena 1
+new
+ih RAND 5000
+it meerkat_panda_squirrel_vulture_wolf 100
+sort
+free
+reset
+new
+ih gerbil 100
+rh gerbil
+free
+reset
+reset
+option arena 0
@@ -0,0 +1,16 @@
+# Test of tracking only a sample of blocks
+option fail 0
+option malloc 0
+option pool 0
+option sample 16
+new
+ih RAND 5000
+it meerkat_panda_squirrel_vulture_wolf 100
+ah _and_bear 10
+sort
+reverse
+rh
+rt
+free
+option sample 1
+option pool 1
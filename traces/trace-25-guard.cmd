@@ -0,0 +1,16 @@
+# Test of blocks placed before a guard page
+option fail 0
+option malloc 0
+option pool 0
+option guard 1
+new
+ih a
+ih dolphin
+it aardvark_bear_dolphin_gerbil_jaguar
+ih RAND 1000
+at _and_wolf 5
+sort
+rt
+free
+option guard 0
+option pool 1
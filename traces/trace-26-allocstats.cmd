@@ -0,0 +1,14 @@
+# Test of allocation statistics per call site
+option fail 0
+option malloc 0
+option pool 0
+allocstats reset
+new
+ih dolphin 100
+it aardvark_bear_dolphin_gerbil_jaguar 100
+allocstats
+free
+allocstats
+allocstats reset
+allocstats
+option pool 1
@@ -0,0 +1,14 @@
+# Test of queues and allocations on several threads at once
+option fail 0
+option malloc 0
+stress
+stress 8 1000
+option sample 4
+stress 4 5000
+option sample 1
+option pool 0
+stress 2 5000
+option guard 1
+stress 4 1000
+option guard 0
+option pool 1
@@ -0,0 +1,18 @@
+# Test of appending to the values at either end
+option fail 10
+option malloc 0
+new
+ih dolphin
+it gerbil
+ah _bear
+at _jaguar
+rh dolphin_bear
+rh gerbil_jaguar
+ih a
+ah b 100
+at c 20
+ah aardvark_bear_dolphin_gerbil_jaguar
+option malloc 50
+ah _wolf 10
+option malloc 0
+free
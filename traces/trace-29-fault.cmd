@@ -0,0 +1,20 @@
+# Test of scheduled malloc failures
+option pool 0
+option fail 30
+option malloc 0
+new
+fault nth 3 in it
+it dolphin
+it gerbil
+it jaguar
+it meerkat
+rh dolphin
+rh jaguar
+rh meerkat
+fault every 3 in ih
+ih bear 10
+fault
+fault off
+ih wolf 10
+free
+option pool 1
@@ -0,0 +1,20 @@
+# Test that a seed repeats the random strings and malloc failures
+option fail 30
+option malloc 0
+option pool 0
+option seed 1
+new
+ih RAND 10
+option malloc 30
+it RAND 20
+option malloc 0
+rh wptdh
+rt kxeiwpf
+free
+option seed 1
+new
+ih RAND 10
+rh wptdh
+rt bbrsh
+free
+option pool 1
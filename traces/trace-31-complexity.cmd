@@ -0,0 +1,7 @@
+# Test of the complexity estimates of queue operations
+option fail 0
+option malloc 0
+complexity ih 1
+complexity rt 1
+complexity size 1
+complexity reverse n